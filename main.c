@@ -14,14 +14,72 @@
 #include <stdarg.h>
 #include <time.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <regex.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+// The build only assumes SSE2. Functions marked TARGET_AVX2 are compiled
+// for AVX2 as well and are called only when the CPU has it.
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define CPU_HAS_AVX2() __builtin_cpu_supports("avx2")
+#endif
 
 #define CTRL_KEY(k) ((k) & 0x1f)
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
+#define ABUF_MIN_CAP 4096
+#define INPUT_RING_SIZE 65536
+#define ESCAPE_TIMEOUT_MS 100 // wait for the rest of an escape sequence
+#define BACKGROUND_TICK_MS 100
+#define EDITOR_FRAME_MS 0 // least time between frames, 0 for no cap
+#define SCREEN_INVERSE 0x80 // cell attribute bit, the rest is an SGR color
+#define SCREEN_UNKNOWN 0xff // attribute of cells whose contents are unknown
+#define SCREEN_MERGE_GAP 8
 #define EDITOR_VERSION "0.0.1"
 #define EDITOR_TAB_STOP 8
 #define EDITOR_QUIT_TIMES 3
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRING (1<<1)
+#define FIND_MAX_JOBS 16
+#define FIND_ROWS_PER_JOB 4096
+#define FIND_CHECK_BYTES (1 << 20) // text a find worker scans between looks at cancel
+#define SEARCH_CHUNK_ROWS 256
+#define SEARCH_CHUNK_BYTES (1 << 20) // span of a chunk of rows still as loaded
+// Bytes roughly from most to least common in code, prose and logs; those
+// missing are rarer still. Plain searches filter on the two needle bytes
+// found last here, which leaves the fewest offsets to compare.
+#define SEARCH_COMMON " etaonisrlcdhupm.fg_y,;=()0-1b\"2wv/:34985x67*k'TSEACIRNOLDPM>{}<FB[]j&!zq|+UHGW#V%K$XYJ@Z?^Q~`\\\t"
+#define RX_MAX_DFA_STATES 2048 // per lazy DFA, see struct rxDFA
+#define RX_MAX_LITERAL 32
+#define RX_MAX_PATTERN 1024 // longest regex, so the recursive compile stays shallow
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define LOAD_MAX_JOBS 16
+#define LOAD_BYTES_PER_JOB (16 << 20) // least share of a file worth a thread
+#define HL_SPAN_MAX 65535 // longest run one hlSpan covers
+#define SAVE_IOV_BATCH 256
+#define SAVE_CHUNK (1 << 20) // most bytes a snapshot piece covers, for progress
+#define JOURNAL_IDLE_MS 200 // sync the journal once edits pause this long
+#define JOURNAL_MAX_DELAY_MS 1000 // ... or at the latest this long after an edit
+#define JOURNAL_FLUSH_BYTES (1 << 20) // write buffered records out past this
+#define JOURNAL_MAGIC "BXJ1\0\0\0\0"
+#ifndef UNDO_MEMORY_LIMIT
+#define UNDO_MEMORY_LIMIT (64 << 20) // bytes of undo history, the oldest goes first
+#endif
+// A row borrowing from E.map reads the file itself. If another program
+// truncates the file while it is open, as log rotation does, touching such
+// a row raises SIGBUS and editorHandleSigbus() ends the editor; what the
+// journal holds is recovered on the next open.
+#define ROW_BORROWED (1<<0) // chars points into E.map or E.arena, not owned by the row
+#define ROW_RENDER_STALE (1<<1) // render no longer matches chars
+#define ROW_HL_STALE (1<<2) // hl needs a re-lex
+#define ROW_STATE_STALE (1<<3) // hl_open_comment needs a re-lex
+#define ROW_RENDER_ALIAS (1<<4) // render is chars itself, the row has no tabs
+#define ROW_FROZEN (1<<5) // chars is owned but borrowed by a running save
 
 enum editorKey{
     BACKSPACE = 127,
@@ -33,7 +91,25 @@ enum editorKey{
     PAGE_DOWN,
     HOME_KEY,
     END_KEY,
-    DEL_KEY
+    DEL_KEY,
+    PASTE_KEY, // a bracketed paste, its text is in E.input.paste
+    IDLE_KEY // no key: a timer, a resize or background work wants a redraw
+};
+
+enum editorTimer{
+    TIMER_ESCAPE,
+    TIMER_BACKGROUND,
+    TIMER_FRAME,
+    TIMER_JOURNAL,
+    EDITOR_TIMERS
+};
+
+enum keyDecoderState{
+    KEY_GROUND,
+    KEY_ESC,
+    KEY_CSI,
+    KEY_SS3,
+    KEY_PASTE
 };
 
 enum editorHighlight{
@@ -48,32 +124,241 @@ enum editorHighlight{
     HL_IDENTIFIER
 };
 
+// Edits the journal records, each replayed through the same function that
+// made it with the cursor where it was.
+enum journalOp{
+    JOURNAL_CHAR = 1, // editorInsertChar()
+    JOURNAL_DEL, // editorDelChar()
+    JOURNAL_NEWLINE, // editorInsertNewline()
+    JOURNAL_TEXT, // editorInsertText()
+    JOURNAL_ERASE, // editorEraseText(), for undo and redo
+    JOURNAL_PUT // editorPutText(), for undo and redo
+};
+
 enum OPERATIONS{
     NO_OP = -1,
     INSERT,
     DELETE,
-    SAVE
+    SAVE,
+    UNDO,
+    REDO
 };
 
 // terminal
+void editorJournalSync();
+int editorOnMainThread();
+
 void die(const char *s){
     perror(s);
+    // what the journal holds can still be recovered, but a worker dying
+    // must leave it alone: the main thread may be writing it right now
+    if(editorOnMainThread()) editorJournalSync();
     exit(1);
 }
 
+// A run of render columns in one highlight class. A row's spans ascend and
+// leave out HL_NORMAL text.
+struct hlSpan{
+    int start;
+    unsigned short len;
+    unsigned char hl;
+};
+
+// A tab of a row and the render column just past its expansion.
+struct tabStop{
+    int cx;
+    int rx;
+};
+
 typedef struct erow{
-    int idx;
     int size;
     char *chars;
     char *render;
     int rsize;
-    unsigned char *hl;
+    struct hlSpan *hl;
+    int nhl;
     int hl_open_comment;
+    int flags;
+    int owned; // 1 + the row's entry in E.owned, 0 if it is not listed
+    struct tabStop *tabs; // every tab in chars, ascending, built with render
+    int ntabs;
+    int charscap, rendercap, hlcap, tabscap; // bytes allocated, 0 if borrowed or none
+    int render_from; // while ROW_RENDER_STALE, chars before this are rendered
 } erow;
 
+struct editorSearch{
+    const char *needle;
+    size_t len;
+    size_t skip[256]; // Horspool shift for each byte
+    size_t rare[2]; // offsets of the needle's two rarest bytes, see SEARCH_COMMON
+    struct regex *re; // set for regex searches, shared between threads
+    struct regexMatcher *matcher; // private to the thread searching
+};
+
+// One worker's share of a find: every match in rows [from, to).
+struct findJob{
+    pthread_t thread;
+    int joinable;
+    int from, to;
+    struct editorSearch search;
+    int *hits; // (row, col) pairs in ascending order
+    int nhits;
+    int hitcap;
+    int published; // hits the UI may count, guarded by findIndex.lock
+    size_t scanned; // bytes since the last look at cancel
+    int done;
+};
+
+// Index of every match of the current find query, built by a pool of
+// workers while the prompt stays responsive.
+struct findIndex{
+    int active;
+    char *query;
+    int regex; // query is a pattern, see regexCompile()
+    int bad; // ... that does not parse: 1, or is over RX_MAX_PATTERN: 2
+    struct editorSearch search;
+    struct findJob jobs[FIND_MAX_JOBS];
+    int njobs;
+    pthread_mutex_t lock;
+    int cancel;
+    int *hits; // all jobs' hits merged in order, once every job is done
+    int nhits;
+    int merged;
+    int row, col; // match the cursor was last moved to
+};
+
+// One thread's share of indexing the mapped file: the lines that start in
+// [from, to). They are counted first, then written to rows once every
+// share has been counted and the row array allocated.
+struct loadJob{
+    pthread_t thread;
+    int joinable;
+    const char *from, *to;
+    long nrows;
+    erow *rows;
+};
+
+// A piece of a save snapshot: len bytes of text, then a newline if the
+// text does not carry its own.
+struct savePiece{
+    const char *text;
+    int len;
+    int newline;
+};
+
+// A save in progress. The text is snapshotted as pieces pointing into the
+// mapping, the arena and the rows' own buffers; those buffers are frozen
+// (ROW_FROZEN) so that edits copy a row out instead of changing it, and a
+// worker writes the pieces out while editing goes on.
+struct saveJob{
+    int active;
+    pthread_t thread;
+    struct savePiece *pieces;
+    int npieces, piececap; // piececap in bytes
+    char *target, *tmp;
+    mode_t mode;
+    long long total;
+    int dirty; // E.dirty when the snapshot was taken
+    int cy, cx;
+    char **orphans; // frozen chars that no row uses any more
+    int norphans, orphancap; // orphancap in bytes
+    pthread_mutex_t lock;
+    long long written; // guarded by lock
+    int done; // guarded by lock
+    int err; // errno of a failed save, 0 once it worked
+};
+
+// One edit as a delta: at (y, x), rem was replaced by ins, in the text of
+// the buffer with every row ending in '\n'. Undo puts rem back.
+struct undoRecord{
+    int y, x;
+    int cy[2], cx[2]; // cursor before and after the edit
+    char *text; // rem followed by ins
+    int remlen, inslen;
+    int cap; // bytes allocated for text
+    int typing; // a run of typed chars on one row, later ones may join it
+};
+
+// Undo history, oldest first. Records [0, cur) are applied, [cur, n) were
+// undone and can be redone until the next edit.
+struct editorUndo{
+    struct undoRecord *recs;
+    int n, cur;
+    int reccap; // bytes allocated for recs
+    size_t bytes; // memory held by the records, kept under limit
+    size_t limit;
+    int sealed; // the next typed char starts a new record
+};
+
+// Block of row text that is freed all at once with the rest of E.arena.
+struct arenaBlock{
+    struct arenaBlock *next;
+    size_t used, cap;
+    char data[];
+};
+
+// Output buffer for a frame. It is reset rather than freed between frames,
+// so once it has grown to a full screen drawing allocates nothing.
+struct abuf{
+    char *b;
+    int len;
+    int cap;
+};
+
+// Journal of the edits made since the file was loaded or saved, kept next
+// to it so they can be replayed after a crash. Records are buffered and
+// written with one fsync once editing pauses, see editorJournalLog().
+struct editorJournal{
+    char *path; // NULL if there is no journal
+    int fd;
+    struct abuf pending; // records not written yet
+    long long size; // bytes written to fd
+    long long mark; // journal offset of the running save's snapshot
+    int unsynced; // records since the last fsync
+    long long first; // editorNow() of the oldest of them
+};
+
+// Starts every journal: the file its records apply to, as stat() saw it.
+struct journalHeader{
+    char magic[8];
+    long long size;
+    long long mtime, mtime_nsec;
+    long long ino;
+};
+
+// What the terminal shows, cell by cell, so that a refresh sends only the
+// cells that changed. Text lines are only recomposed when the file rows
+// they show were damaged since the last refresh.
+struct editorScreen{
+    int rows, cols; // size the cells were recorded at
+    char *chars;
+    unsigned char *attrs;
+    char *line; // the line being composed
+    unsigned char *line_attrs;
+    int linelen;
+    int rowoffset, coloffset; // scroll position the text lines show
+    int damage_from, damage_to; // file rows to recompose, [from, to)
+    int cury, curx; // terminal cursor, -1 if unknown
+    int attr; // terminal attribute, -1 if unknown
+};
+
+struct editorInput{
+    unsigned char ring[INPUT_RING_SIZE];
+    size_t head, tail; // bytes [tail, head) are unread, indices wrap
+    int state; // enum keyDecoderState
+    int param; // numeric parameter of the CSI sequence being decoded
+    struct abuf paste; // text of the bracketed paste being read
+    int pastematch; // bytes of the closing ESC[201~ seen so far
+    long long deadline[EDITOR_TIMERS]; // editorNow() ms, -1 if disarmed
+    int wakefd[2]; // self-pipe that interrupts poll()
+    volatile sig_atomic_t resized;
+    int started;
+};
+
 struct editorConfig{
     // data
     struct termios orig_termios;
+    pthread_t main_thread; // the only thread that touches E outside of job structs
     int screenrows;
     int screencols;
     // cursor position
@@ -81,7 +366,24 @@ struct editorConfig{
     int numrows;
     int rowoffset;
     int coloffset;
-    erow *row;
+    erow *row; // gap buffer of rows, see editorRowAt()
+    int rowcap;
+    int gapstart;
+    int *owned; // E.row slots of the rows holding memory of their own
+    int nowned, ownedcap; // ownedcap in bytes
+    char *map; // read-only mapping of the opened file, NULL if not mapped
+    size_t mapsize;
+    int hl_frontier; // rows above this have settled hl_open_comment state
+    int map_rows; // rows above this are E.map's lines as loaded, in order
+    int match_row, match_from, match_to; // render columns find shows as HL_MATCH, row -1 if none
+    struct arenaBlock *arena; // text borrowed by rows not in E.map, newest first
+    struct findIndex find;
+    struct saveJob save;
+    struct editorJournal journal;
+    struct editorUndo undo;
+    struct abuf frame; // reused by every editorRefreshScreen()
+    struct editorScreen screen;
+    struct editorInput input;
     int dirty;
     char *filename;
     char statusmsg[80];
@@ -92,19 +394,24 @@ struct editorConfig{
     struct editorSyntax *syntax;
 };
 
+struct editorKeyword{
+    char *word;
+    int len;
+    unsigned char hl;
+};
+
 struct editorSyntax{
     char *filetype;
     char **filematch;
     char **keywords;
-    char **singleline_comment_start;
+    char *singleline_comment_start;
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
-};
-
-struct abuf{
-    char *b;
-    int len;
+    // keywords compiled into an open-addressed hash table on first selection
+    struct editorKeyword *kwtable;
+    unsigned int kwmask;
+    int kwmaxlen;
 };
 
 struct editorConfig E;
@@ -127,7 +434,8 @@ struct editorSyntax HLDB[] = {
         "//", 
         "/*", 
         "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRING
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRING,
+        NULL, 0, 0
     },
 };
 
@@ -135,71 +443,38 @@ struct editorSyntax HLDB[] = {
 
 /*** prototypes ***/
 void editorSetStatusMessage(const char *fmt, ...);
+int editorBackgroundBusy();
+void editorDamageRows(int from, int to);
+int editorRowInMap(erow *row);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 void updateOperation(int operation);
-
-void abAppend(struct abuf *ab, const char *s, int len){
-    char *new = realloc(ab->b, ab->len + len);
-
-    if(new == NULL) return;
-    memcpy(&new[ab->len], s, len);
+void editorJournalLog(int op, const char *s, int len);
+void editorJournalOpen();
+void editorJournalClose(int discard);
+void editorJournalRebase(const char *target);
+void editorUndoPush(int y, int x, const char *rem, int remlen, const char *ins, int inslen, int eof);
+void editorUndoCursor();
+
+// Makes room for len more bytes, doubling the capacity as needed.
+void abReserve(struct abuf *ab, int len){
+    if(ab->len + len <= ab->cap) return;
+    int cap = ab->cap ? ab->cap : ABUF_MIN_CAP;
+    while(cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if(new == NULL) die("realloc");
     ab->b = new;
-    ab->len += len;
+    ab->cap = cap;
 }
 
-void abFree(struct abuf *ab){
-    free(ab->b);
+void abAppend(struct abuf *ab, const char *s, int len){
+    abReserve(ab, len);
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
 }
 
-int editorReadKey(){
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1){
-        if (nread == -1 && errno != EAGAIN) die("read");
-    }
-
-    if (c == '\x1b'){
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-        if (seq[0] == '['){
-            if(seq[1] > 0 && seq[1] <= 9){
-                if(read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if(seq[2] == '~'){
-                    switch(seq[1]){
-                    case '1': case '7':
-                        return HOME_KEY;
-                    case '4': case '8':
-                        return END_KEY;
-                    case '3':
-                        return DEL_KEY;
-                    case '5':
-                        return PAGE_UP;
-                    case '6':
-                        return PAGE_DOWN;
-                    }
-                }
-            }
-            else{
-                switch (seq[1]){
-            case 'A':
-                return ARROW_UP;
-            case 'B':
-                return ARROW_DOWN;
-            case 'C':
-                return ARROW_RIGHT;
-            case 'D':
-                return ARROW_LEFT;
-            }
-            }
-        }
-        return '\x1b';
-    }
-    else
-    {
-        return c;
-    }
+void abReset(struct abuf *ab){
+    ab->len = 0;
 }
 
 int getCursorPosition(int *rows, int *cols){
@@ -209,6 +484,8 @@ int getCursorPosition(int *rows, int *cols){
     if(write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
     while(i < sizeof(buf) - 1){
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if(poll(&pfd, 1, 1000) != 1) break;
         if(read(STDIN_FILENO, &buf[i], 1) != 1) break;
         if(buf[i] == 'R') break;
         i++;
@@ -234,6 +511,398 @@ int getWindowSize(int *rows, int *cols){
     }
 }
 
+/*** input ***/
+
+// Keys are decoded from a ring of bytes read in bulk. The decoder keeps its
+// place across reads, so an escape sequence split between two reads still
+// decodes; a lone ESC is told apart from the start of a sequence by a
+// timer. editorReadKey() sleeps in poll() until input, a timer, a resize or
+// a wake-up from a background thread arrives.
+
+long long editorNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void editorSetTimer(int timer, int ms){
+    E.input.deadline[timer] = editorNow() + ms;
+}
+
+void editorClearTimer(int timer){
+    E.input.deadline[timer] = -1;
+}
+
+// Interrupts a poll() in progress or the next one. Safe to call from
+// signal handlers and other threads.
+void editorWake(){
+    if(!E.input.started) return;
+    char c = 0;
+    if(write(E.input.wakefd[1], &c, 1) == -1){
+        // the pipe is full, so a wake-up is already pending
+    }
+}
+
+void editorHandleSigwinch(int sig){
+    (void)sig;
+    E.input.resized = 1;
+    editorWake();
+}
+
+// The mapped file lost the page being read. Nothing in it can be trusted
+// any more, so leave the terminal as it was found and exit, with only
+// async-signal-safe calls. Other faults get the default action.
+void editorHandleSigbus(int sig, siginfo_t *info, void *ctx){
+    (void)ctx;
+    char *addr = info->si_addr;
+    if(E.map == NULL || addr < E.map || addr >= E.map + E.mapsize){
+        signal(sig, SIG_DFL);
+        return;
+    }
+    static const char msg[] = "\x1b[?2004l\x1b[2J\x1b[H"
+        "The open file was truncated by another program.\r\n";
+    write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios);
+    _exit(1);
+}
+
+void editorInitInput(){
+    struct editorInput *in = &E.input;
+    in->head = in->tail = 0;
+    in->state = KEY_GROUND;
+    in->paste = (struct abuf)ABUF_INIT;
+    for(int t = 0; t < EDITOR_TIMERS; t++) in->deadline[t] = -1;
+
+    if(pipe(in->wakefd) == -1) die("pipe");
+    for(int j = 0; j < 2; j++){
+        fcntl(in->wakefd[j], F_SETFL, O_NONBLOCK);
+        fcntl(in->wakefd[j], F_SETFD, FD_CLOEXEC);
+    }
+    in->started = 1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorHandleSigwinch;
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+    // a hangup is left to poll(), which sees POLLHUP on the terminal and
+    // syncs the journal before exiting
+    sa.sa_handler = SIG_IGN;
+    if(sigaction(SIGHUP, &sa, NULL) == -1) die("sigaction");
+    sa.sa_sigaction = editorHandleSigbus;
+    sa.sa_flags = SA_SIGINFO;
+    if(sigaction(SIGBUS, &sa, NULL) == -1) die("sigaction");
+}
+
+void editorUpdateWindowSize(){
+    if(getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    E.screenrows -= 3;
+    if(E.screenrows < 1) E.screenrows = 1;
+    if(E.screencols < 1) E.screencols = 1;
+}
+
+// Maps a complete CSI or SS3 sequence to a key, or 0 to drop it.
+int editorSequenceKey(int final, int param){
+    switch(final){
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+        case '~':
+            switch(param){
+                case 1: case 7: return HOME_KEY;
+                case 4: case 8: return END_KEY;
+                case 3: return DEL_KEY;
+                case 5: return PAGE_UP;
+                case 6: return PAGE_DOWN;
+            }
+    }
+    return 0;
+}
+
+// Moves the text of a bracketed paste from the ring to E.input.paste. Runs
+// without ESC are copied whole. Returns 1 once the closing ESC[201~ has
+// been consumed, or 0 if the ring ran dry first.
+int editorDecodePaste(){
+    static const char end[] = "\x1b[201~";
+    struct editorInput *in = &E.input;
+    while(in->head != in->tail){
+        if(in->pastematch == 0){
+            size_t at = in->tail % INPUT_RING_SIZE;
+            size_t n = in->head - in->tail;
+            if(n > INPUT_RING_SIZE - at) n = INPUT_RING_SIZE - at;
+            unsigned char *esc = memchr(&in->ring[at], '\x1b', n);
+            size_t run = esc ? (size_t)(esc - &in->ring[at]) : n;
+            abAppend(&in->paste, (char *)&in->ring[at], run);
+            in->tail += run;
+            if(esc == NULL) continue;
+        }
+
+        unsigned char c = in->ring[in->tail % INPUT_RING_SIZE];
+        in->tail++;
+        if(c == (unsigned char)end[in->pastematch]){
+            if(++in->pastematch < (int)sizeof(end) - 1) continue;
+            in->pastematch = 0;
+            return 1;
+        }
+        // a false start: what matched so far was pasted text
+        abAppend(&in->paste, end, in->pastematch);
+        in->pastematch = c == '\x1b';
+        if(c != '\x1b') abAppend(&in->paste, (char *)&c, 1);
+    }
+    return 0;
+}
+
+// Feeds buffered bytes to the decoder until a key completes. Returns 1
+// with the key in *key, or 0 once the ring is empty.
+int editorDecodeKey(int *key){
+    struct editorInput *in = &E.input;
+    while(in->head != in->tail){
+        if(in->state == KEY_PASTE){
+            if(!editorDecodePaste()) return 0;
+            in->state = KEY_GROUND;
+            *key = PASTE_KEY;
+            return 1;
+        }
+
+        unsigned char c = in->ring[in->tail % INPUT_RING_SIZE];
+        in->tail++;
+
+        switch(in->state){
+            case KEY_GROUND:
+                if(c == '\x1b'){
+                    in->state = KEY_ESC;
+                    editorSetTimer(TIMER_ESCAPE, ESCAPE_TIMEOUT_MS);
+                    continue;
+                }
+                *key = c;
+                return 1;
+            case KEY_ESC:
+                if(c == '[' || c == 'O'){
+                    in->state = c == '[' ? KEY_CSI : KEY_SS3;
+                    in->param = 0;
+                    continue;
+                }
+                // not a sequence: ESC was a key of its own, and so is c
+                in->tail--;
+                in->state = KEY_GROUND;
+                editorClearTimer(TIMER_ESCAPE);
+                *key = '\x1b';
+                return 1;
+            case KEY_CSI:
+                if(c >= '0' && c <= '9'){
+                    if(in->param < 10000) in->param = in->param * 10 + (c - '0');
+                    continue;
+                }
+                if(c < 0x40 || c > 0x7e) continue; // other parameter bytes
+                // fall through
+            case KEY_SS3:
+                in->state = KEY_GROUND;
+                editorClearTimer(TIMER_ESCAPE);
+                if(c == '~' && in->param == 200){
+                    // ESC[200~ opens a bracketed paste
+                    in->state = KEY_PASTE;
+                    abReset(&in->paste);
+                    in->pastematch = 0;
+                    continue;
+                }
+                *key = editorSequenceKey(c, in->param);
+                if(*key) return 1;
+                continue;
+        }
+    }
+    return 0;
+}
+
+// Reads whatever input is available, up to the free space in the ring.
+void editorFillInput(){
+    struct editorInput *in = &E.input;
+    while(in->head - in->tail < INPUT_RING_SIZE){
+        size_t at = in->head % INPUT_RING_SIZE;
+        size_t room = INPUT_RING_SIZE - (in->head - in->tail);
+        if(room > INPUT_RING_SIZE - at) room = INPUT_RING_SIZE - at;
+        ssize_t n = read(STDIN_FILENO, &in->ring[at], room);
+        if(n == -1 && errno == EINTR) continue;
+        if(n == -1 && errno != EAGAIN) die("read");
+        if(n <= 0) return;
+        in->head += n;
+    }
+}
+
+// Returns 1 if a key can be read without waiting, so a burst of input such
+// as a paste is applied in full before the next frame is drawn.
+int editorInputPending(){
+    struct editorInput *in = &E.input;
+    editorFillInput();
+    return in->head != in->tail;
+}
+
+// With a frame cap, returns 1 until EDITOR_FRAME_MS have passed since the
+// frame drawn at `last`, arming a timer so editorReadKey() wakes by then.
+int editorFrameWait(long long last){
+    long long left = last + EDITOR_FRAME_MS - editorNow();
+    if(left <= 0){
+        editorClearTimer(TIMER_FRAME);
+        return 0;
+    }
+    if(E.input.deadline[TIMER_FRAME] == -1) editorSetTimer(TIMER_FRAME, left);
+    return 1;
+}
+
+int editorReadKey(){
+    struct editorInput *in = &E.input;
+    while(1){
+        int key;
+        if(editorDecodeKey(&key)) return key;
+
+        if(in->resized){
+            in->resized = 0;
+            editorUpdateWindowSize();
+            return IDLE_KEY;
+        }
+
+        // background work is reported on a tick while it lasts
+        if(editorBackgroundBusy()){
+            if(in->deadline[TIMER_BACKGROUND] == -1) editorSetTimer(TIMER_BACKGROUND, BACKGROUND_TICK_MS);
+        }else{
+            editorClearTimer(TIMER_BACKGROUND);
+        }
+
+        long long now = editorNow();
+        int timeout = -1;
+        for(int t = 0; t < EDITOR_TIMERS; t++){
+            if(in->deadline[t] == -1) continue;
+            if(in->deadline[t] <= now){
+                editorClearTimer(t);
+                if(t == TIMER_ESCAPE){
+                    in->state = KEY_GROUND;
+                    return '\x1b';
+                }
+                if(t == TIMER_JOURNAL){
+                    editorJournalSync();
+                    continue;
+                }
+                return IDLE_KEY;
+            }
+            if(timeout == -1 || in->deadline[t] - now < timeout) timeout = in->deadline[t] - now;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = in->head - in->tail < INPUT_RING_SIZE ? POLLIN : 0;
+        fds[1].fd = in->wakefd[0];
+        fds[1].events = POLLIN;
+        if(poll(fds, 2, timeout) == -1){
+            if(errno == EINTR) continue;
+            die("poll");
+        }
+
+        if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)){
+            // the terminal is gone: keep the edits not synced yet
+            editorJournalSync();
+            exit(1);
+        }
+        if(fds[0].revents & POLLIN) editorFillInput();
+        if(fds[1].revents & POLLIN){
+            char drain[64];
+            while(read(in->wakefd[0], drain, sizeof(drain)) > 0);
+            if(!in->resized && in->head == in->tail) return IDLE_KEY;
+        }
+    }
+}
+
+/*** row storage ***/
+
+// E.row is a gap buffer: rows [0, gapstart) sit at the front of the array,
+// the remaining rows sit at its end, and the free slots in between form the
+// gap. Inserting or deleting a row moves the gap to the edit point, so edits
+// near the previous one only shift the rows in between.
+erow *editorRowAt(int at){
+    if(at >= E.gapstart) at += E.rowcap - E.numrows;
+    return &E.row[at];
+}
+
+// Follows the rows of slots [from, to) to `delta` slots away in E.owned.
+// Rows change slots only when the gap moves over them; the shorter of the
+// list and the moved rows is walked, so this costs no more than the move.
+void editorRowsMoved(int from, int to, int delta){
+    if(E.nowned < to - from){
+        for(int k = 0; k < E.nowned; k++){
+            if(E.owned[k] >= from && E.owned[k] < to) E.owned[k] += delta;
+        }
+        return;
+    }
+    for(int i = from + delta; i < to + delta; i++){
+        if(E.row[i].owned) E.owned[E.row[i].owned - 1] = i;
+    }
+}
+
+void editorMoveGap(int at){
+    int gaplen = E.rowcap - E.numrows;
+    if(at < E.gapstart){
+        memmove(&E.row[at + gaplen], &E.row[at], sizeof(erow) * (E.gapstart - at));
+        editorRowsMoved(at, E.gapstart, gaplen);
+    }else if(at > E.gapstart){
+        memmove(&E.row[E.gapstart], &E.row[E.gapstart + gaplen], sizeof(erow) * (at - E.gapstart));
+        editorRowsMoved(E.gapstart + gaplen, at + gaplen, -gaplen);
+    }
+    E.gapstart = at;
+}
+
+int editorGrowRows(){
+    int newcap = E.rowcap ? E.rowcap * 2 : 64;
+    erow *new_row = realloc(E.row, sizeof(erow) * newcap);
+    if(new_row == NULL) return -1;
+
+    int tail = E.numrows - E.gapstart;
+    memmove(&new_row[newcap - tail], &new_row[E.rowcap - tail], sizeof(erow) * tail);
+    E.row = new_row;
+    editorRowsMoved(E.rowcap - tail, E.rowcap, newcap - E.rowcap);
+    E.rowcap = newcap;
+    return 0;
+}
+
+// Grows a row buffer to hold at least `need` bytes. The capacity doubles, so
+// a row edited a byte at a time is reallocated O(log n) times.
+void *editorRowGrow(void *buf, int *cap, int need){
+    if(buf != NULL && need <= *cap) return buf;
+    int newcap = *cap ? *cap : 16;
+    while(newcap < need) newcap = newcap > INT_MAX / 2 ? need : newcap * 2;
+    buf = realloc(buf, newcap);
+    if(buf == NULL) die("realloc");
+    *cap = newcap;
+    return buf;
+}
+
+// Lists a row that is about to hold memory of its own in E.owned, so that
+// editorFreeRows() visits it and skips the rows that only borrow.
+void editorRowClaim(erow *row){
+    if(row->owned) return;
+    E.owned = editorRowGrow(E.owned, &E.ownedcap, (E.nowned + 1) * sizeof(int));
+    E.owned[E.nowned++] = row - E.row;
+    row->owned = E.nowned;
+}
+
+// Takes a row being freed off E.owned; the last entry fills its place.
+void editorRowRelease(erow *row){
+    if(!row->owned) return;
+    int last = E.owned[--E.nowned];
+    E.owned[row->owned - 1] = last;
+    E.row[last].owned = row->owned;
+    row->owned = 0;
+}
+
+// Hands the chars of a frozen row to the running save, which still writes
+// them and frees them once it is done.
+void editorRowOrphan(erow *row){
+    struct saveJob *job = &E.save;
+    job->orphans = editorRowGrow(job->orphans, &job->orphancap, (job->norphans + 1) * sizeof(char *));
+    job->orphans[job->norphans++] = row->chars;
+    row->flags &= ~ROW_FROZEN;
+}
+
 /*** syntax highlighting ***/
 
 int is_separator(int c){
@@ -244,13 +913,157 @@ int isIdentifier(char c){
     return isalnum(c) || c == '_';
 }
 
-void editorUpdateSyntax(erow *row){
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+unsigned int editorHashKeyword(const char *s, int len){
+    unsigned int h = 2166136261u;
+    for(int i = 0; i < len; i++){
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Builds the keyword table for a syntax, with each keyword's length and
+// KEYWORD1/KEYWORD2 class worked out once. The table is kept at most half
+// full so a lookup rarely probes past its first slot.
+void editorCompileKeywords(struct editorSyntax *s){
+    if(s->kwtable) return;
+
+    unsigned int n = 0;
+    while(s->keywords[n]) n++;
+    unsigned int size = 16;
+    while(size < n * 2) size <<= 1;
+
+    s->kwtable = calloc(size, sizeof(struct editorKeyword));
+    if(s->kwtable == NULL) die("calloc");
+    s->kwmask = size - 1;
+    s->kwmaxlen = 0;
+
+    for(unsigned int j = 0; j < n; j++){
+        char *word = s->keywords[j];
+        int len = strlen(word);
+        int kw2 = word[len - 1] == '|';
+        if(kw2) len--;
+
+        unsigned int h = editorHashKeyword(word, len) & s->kwmask;
+        while(s->kwtable[h].word) h = (h + 1) & s->kwmask;
+        s->kwtable[h].word = word;
+        s->kwtable[h].len = len;
+        s->kwtable[h].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        if(len > s->kwmaxlen) s->kwmaxlen = len;
+    }
+}
+
+struct editorKeyword *editorLookupKeyword(struct editorSyntax *s, const char *word, int len){
+    if(len == 0 || len > s->kwmaxlen) return NULL;
+
+    unsigned int h = editorHashKeyword(word, len) & s->kwmask;
+    while(s->kwtable[h].word){
+        struct editorKeyword *kw = &s->kwtable[h];
+        if(kw->len == len && !memcmp(kw->word, word, len)) return kw;
+        h = (h + 1) & s->kwmask;
+    }
+    return NULL;
+}
+
+// Marks a row for a re-lex and pulls the frontier back so the next
+// editorHighlightRows() walk reaches it.
+void editorInvalidateSyntax(int filerow){
+    editorRowAt(filerow)->flags |= ROW_HL_STALE | ROW_STATE_STALE;
+    if(filerow < E.hl_frontier) E.hl_frontier = filerow;
+}
+
+// Computes only the multiline comment state at the end of a row, straight
+// from chars. Tabs never start or end a comment or string, so this agrees
+// with editorUpdateSyntax() without building render or hl.
+int editorSyntaxEndState(erow *row, int in_comment){
+    if(E.syntax == NULL) return 0;
+
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int in_string = 0;
+    int i = 0;
+    while(i < row->size){
+        char c = row->chars[i];
+        int left = row->size - i;
+
+        if(scs_len && !in_string && !in_comment){
+            if(left >= scs_len && !memcmp(&row->chars[i], scs, scs_len)) return 0;
+        }
+
+        if(mcs_len && mce_len && !in_string){
+            if(in_comment){
+                if(left >= mce_len && !memcmp(&row->chars[i], mce, mce_len)){
+                    i += mce_len;
+                    in_comment = 0;
+                }else{
+                    i++;
+                }
+                continue;
+            }else if(left >= mcs_len && !memcmp(&row->chars[i], mcs, mcs_len)){
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+        if(E.syntax->flags & HL_HIGHLIGHT_STRING){
+            if(in_string){
+                if(c == '\\' && i + 1 < row->size){
+                    i += 2;
+                    continue;
+                }
+                if(c == in_string) in_string = 0;
+            }else if(c == '"' || c == '\''){
+                in_string = c;
+            }
+        }
+        i++;
+    }
+    return in_comment;
+}
+
+// Stores the runs of hl[0, rsize) other than HL_NORMAL as the row's spans.
+void editorRowSetSpans(erow *row, const unsigned char *hl){
+    int i = 0;
+    while(i < row->rsize){
+        if(hl[i] == HL_NORMAL){
+            i++;
+            continue;
+        }
+        int j = i + 1;
+        while(j < row->rsize && hl[j] == hl[i] && j - i < HL_SPAN_MAX) j++;
+        editorRowClaim(row);
+        row->hl = editorRowGrow(row->hl, &row->hlcap, (row->nhl + 1) * sizeof(struct hlSpan));
+        row->hl[row->nhl].start = i;
+        row->hl[row->nhl].len = j - i;
+        row->hl[row->nhl].hl = hl[i];
+        row->nhl++;
+        i = j;
+    }
+}
+
+void editorUpdateSyntax(int filerow){
+    erow *row = editorRowAt(filerow);
+    editorDamageRows(filerow, filerow + 1);
+    row->flags &= ~(ROW_HL_STALE | ROW_STATE_STALE);
+    row->nhl = 0;
 
-    if(E.syntax == NULL) return;
+    if(E.syntax == NULL){
+        row->hl_open_comment = 0;
+        return;
+    }
 
-    char **keywords = E.syntax->keywords;
+    // lexed a byte per column into a shared buffer, then stored as spans
+    static unsigned char *hl = NULL;
+    static int hlcap = 0;
+    hl = editorRowGrow(hl, &hlcap, row->rsize);
+    memset(hl, HL_NORMAL, row->rsize);
 
     char *scs = E.syntax->singleline_comment_start;
     char *mcs = E.syntax->multiline_comment_start;
@@ -262,26 +1075,26 @@ void editorUpdateSyntax(erow *row){
 
     int prev_sep = 1;
     int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    int in_comment = (filerow > 0 && editorRowAt(filerow - 1)->hl_open_comment);
     int in_identifier = 0;
 
     int i = 0;
     while( i < row->rsize){
         char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
         
         if(scs_len && !in_string && !in_comment){
-            if(!strncmp(&row->render[i], scs, scs_len)){
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+            if(i + scs_len <= row->rsize && !memcmp(&row->render[i], scs, scs_len)){
+                memset(&hl[i], HL_COMMENT, row->rsize - i);
                 break;
             }
         }
 
         if(mcs_len && mce_len && !in_string){
             if(in_comment){
-                row->hl[i] = HL_MULTILINE_COMMENT;
-                if(!strncmp(&row->render[i], mce, mce_len)){
-                    memset(&row->hl[i], HL_MULTILINE_COMMENT,mce_len);
+                hl[i] = HL_MULTILINE_COMMENT;
+                if(i + mce_len <= row->rsize && !memcmp(&row->render[i], mce, mce_len)){
+                    memset(&hl[i], HL_MULTILINE_COMMENT,mce_len);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -290,8 +1103,8 @@ void editorUpdateSyntax(erow *row){
                     i++;
                     continue;
                 }
-            }else if(!strncmp(&row->render[i], mcs, mcs_len)){
-                memset(&row->hl[i], HL_MULTILINE_COMMENT, mcs_len);
+            }else if(i + mcs_len <= row->rsize && !memcmp(&row->render[i], mcs, mcs_len)){
+                memset(&hl[i], HL_MULTILINE_COMMENT, mcs_len);
                 i += mcs_len;
                 in_comment = 1;
                 continue;
@@ -300,9 +1113,9 @@ void editorUpdateSyntax(erow *row){
 
         if(E.syntax->flags & HL_HIGHLIGHT_STRING){
             if(in_string){
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
                 if(c == '\\' && i + 1 < row->rsize){
-                    row->hl[i + 1] = HL_STRING;
+                    hl[i + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -313,7 +1126,7 @@ void editorUpdateSyntax(erow *row){
             }else{
                 if(c == '"' || c=='\''){
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    hl[i] = HL_STRING;
                     i++;
                     continue;
                 }
@@ -322,7 +1135,7 @@ void editorUpdateSyntax(erow *row){
         
         if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS){
             if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)){
-                row->hl[i] = HL_NUMBER;
+                hl[i] = HL_NUMBER;
                 i++;
                 prev_sep = 0;
                 continue;
@@ -330,19 +1143,13 @@ void editorUpdateSyntax(erow *row){
         }
 
         if(prev_sep){
-            int j;
-            for(j = 0; keywords[j];j++){
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if(kw2) klen--;
-
-                if(!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])){
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if(keywords[j] != NULL){
+            // a keyword has to fill the whole token up to the next separator
+            int klen = 0;
+            while(i + klen < row->rsize && !is_separator(row->render[i + klen])) klen++;
+            struct editorKeyword *kw = editorLookupKeyword(E.syntax, &row->render[i], klen);
+            if(kw){
+                memset(&hl[i], kw->hl, kw->len);
+                i += kw->len;
                 prev_sep = 0;
                 continue;
             }
@@ -351,9 +1158,9 @@ void editorUpdateSyntax(erow *row){
         if (isIdentifier(c)) {
             if (!in_identifier) {
                 in_identifier = 1;
-                row->hl[i] = HL_IDENTIFIER;
+                hl[i] = HL_IDENTIFIER;
             } else {
-                row->hl[i] = HL_IDENTIFIER;
+                hl[i] = HL_IDENTIFIER;
             }
         } else {
             in_identifier = 0;
@@ -363,10 +1170,8 @@ void editorUpdateSyntax(erow *row){
         i++;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
-    if(changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    editorRowSetSpans(row, hl);
 }
 
 int editorSyntaxToColor(int hl){
@@ -397,11 +1202,13 @@ void editorSelectSyntaxHiglight(){
             if((is_ext && ext && !strcmp(ext, s->filematch[i])) || 
             (!is_ext && strstr(E.filename, s->filematch[i]))){
                 E.syntax = s;
+                editorCompileKeywords(s);
 
                 int filerow;
                 for(filerow = 0; filerow < E.numrows; filerow++){
-                    editorUpdateSyntax(&E.row[filerow]);
+                    editorRowAt(filerow)->flags |= ROW_HL_STALE | ROW_STATE_STALE;
                 }
+                E.hl_frontier = 0;
                 return;
             }
             i++;
@@ -409,136 +1216,359 @@ void editorSelectSyntaxHiglight(){
     }
 }
 
-int editorRowCxToRx(erow *row, int cx){
-    int rx = 0;
-    int j;
-    for(j = 0; j < cx; j++){
-        if(row->chars[j] == '\t') rx += (EDITOR_TAB_STOP - 1) - (rx % EDITOR_TAB_STOP);
-        rx++;
+// Returns how many tabs of the rendered row come before chars index cx.
+int editorRowTabsBefore(erow *row, int cx){
+    int lo = 0, hi = row->ntabs;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(row->tabs[mid].cx < cx) lo = mid + 1;
+        else hi = mid;
     }
-    return rx;
+    return lo;
 }
 
-int editorRowRxtoCx(erow *row, int rx){
-    int cur_rx = 0;
-    int cx;
+// Marks a row's render and hl out of date after its chars changed from
+// index `at` on. Both are rebuilt lazily, by editorHighlightRows() once the
+// row is on screen, and render only from the first changed char.
+void editorUpdateRowFrom(int filerow, int at){
+    erow *row = editorRowAt(filerow);
+    if(filerow < E.map_rows) E.map_rows = filerow;
+    if(!(row->flags & ROW_RENDER_STALE) || at < row->render_from) row->render_from = at;
+    row->flags |= ROW_RENDER_STALE;
+    editorDamageRows(filerow, filerow + 1);
+    editorInvalidateSyntax(filerow);
+}
+
+void editorUpdateRow(int filerow){
+    editorUpdateRowFrom(filerow, 0);
+}
 
-    for(cx = 0; cx < row->size; cx++){
-        if(row->chars[cx] == '\t')
-            cur_rx += (EDITOR_TAB_STOP - 1) - (cur_rx % EDITOR_TAB_STOP);
-        cur_rx++;
+// Rebuilds render in place. The part rendered from chars that did not
+// change is kept, so an edit only re-renders the rest of its row.
+void editorRowRender(erow *row){
+    if(!(row->flags & ROW_RENDER_STALE)) return;
+
+    // most rows have no tabs, and their render would be a copy of chars
+    if(memchr(row->chars, '\t', row->size) == NULL){
+        if(!(row->flags & ROW_RENDER_ALIAS)) free(row->render);
+        row->render = row->chars;
+        row->rendercap = 0;
+        row->rsize = row->size;
+        row->ntabs = 0;
+        row->flags &= ~ROW_RENDER_STALE;
+        row->flags |= ROW_RENDER_ALIAS | ROW_HL_STALE;
+        return;
+    }
+    if(row->flags & ROW_RENDER_ALIAS){
+        row->render = NULL;
+        row->flags &= ~ROW_RENDER_ALIAS;
+    }
 
-        if(cur_rx > rx) return cx;
+    int from = row->render_from;
+    if(row->render == NULL || from > row->size) from = 0;
+    // tabs before `from` keep their stops, and the render column of `from`
+    // follows from the last of them
+    row->ntabs = editorRowTabsBefore(row, from);
+    int idx = from;
+    if(row->ntabs){
+        struct tabStop *t = &row->tabs[row->ntabs - 1];
+        idx = t->rx + from - t->cx - 1;
     }
-    return cx;
-}
 
-void editorUpdateRow(erow *row){
     int tabs = 0, j;
 
-    for(j = 0; j< row->size; j++){
+    for(j = from; j< row->size; j++){
         if(row->chars[j] == '\t') tabs++;
     }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (EDITOR_TAB_STOP - 1) + 1);
-    int idx = 0;
+    editorRowClaim(row);
+    row->render = editorRowGrow(row->render, &row->rendercap,
+        idx + row->size - from + tabs * (EDITOR_TAB_STOP - 1) + 1);
+    row->tabs = editorRowGrow(row->tabs, &row->tabscap,
+        (row->ntabs + tabs) * sizeof(struct tabStop));
 
-    for(j = 0; j < row->size; j++){
+    for(j = from; j < row->size; j++){
         if(row->chars[j] == '\t'){
             row->render[idx++] = ' ';
             while(idx % EDITOR_TAB_STOP != 0) row->render[idx++] = ' ';
+            row->tabs[row->ntabs].cx = j;
+            row->tabs[row->ntabs].rx = idx;
+            row->ntabs++;
         } else
         row->render[idx++] = row->chars[j];
     }
 
     row->render[idx] = '\0';
     row->rsize = idx;
+    row->flags &= ~ROW_RENDER_STALE;
+    row->flags |= ROW_HL_STALE;
+}
 
-    editorUpdateSyntax(row);
+// Maps a chars index to its render column with a bisection of the row's
+// tab stops, so a long row is not walked from its start on every frame.
+int editorRowCxToRx(erow *row, int cx){
+    editorRowRender(row);
+    int k = editorRowTabsBefore(row, cx);
+    if(k == 0) return cx;
+    return row->tabs[k - 1].rx + cx - row->tabs[k - 1].cx - 1;
 }
 
-void editorInsertRow(int at,char *s, size_t len){
-    if(at < 0 || at > E.numrows) return;
-
-    erow *new_row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    if(new_row == NULL) return;
-    E.row = new_row;
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for(int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+// Returns the chars index shown at render column rx; a column inside a
+// tab's expansion maps to the tab.
+int editorRowRxtoCx(erow *row, int rx){
+    editorRowRender(row);
+    int lo = 0, hi = row->ntabs;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(row->tabs[mid].rx <= rx) lo = mid + 1;
+        else hi = mid;
+    }
+    int cx = lo ? row->tabs[lo - 1].cx + 1 + rx - row->tabs[lo - 1].rx : rx;
+    if(lo < row->ntabs && row->tabs[lo].cx < cx) cx = row->tabs[lo].cx;
+    return cx < row->size ? cx : row->size;
+}
 
-    E.row[at].idx = at;
+erow *editorNewRow(int at){
+    if(at < 0 || at > E.numrows) return NULL;
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    if(E.numrows == E.rowcap && editorGrowRows() == -1) return NULL;
+    editorMoveGap(at);
+    if(at < E.map_rows) E.map_rows = at;
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    erow *row = &E.row[E.gapstart++];
     E.numrows++;
+
+    row->size = 0;
+    row->chars = NULL;
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->nhl = 0;
+    row->tabs = NULL;
+    row->ntabs = 0;
+    row->charscap = row->rendercap = row->hlcap = row->tabscap = 0;
+    row->render_from = 0;
+    // until it is lexed, the new row hands on the state its predecessor
+    // gave to the row that follows it
+    row->hl_open_comment = at > 0 ? editorRowAt(at - 1)->hl_open_comment : 0;
+    row->flags = ROW_RENDER_STALE;
+    row->owned = 0;
+    editorInvalidateSyntax(at);
+    editorDamageRows(at, INT_MAX);
+    return row;
+}
+
+void editorInsertRow(int at,char *s, size_t len){
+    erow *row = editorNewRow(at);
+    if(row == NULL) return;
+
+    row->size = len;
+    editorRowClaim(row);
+    row->chars = editorRowGrow(NULL, &row->charscap, len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    editorUpdateRow(at);
     E.dirty++;
 }
 
+// Carves len bytes out of E.arena. Rows loaded or pasted in bulk borrow
+// their text from it, so they cost no allocation of their own and are
+// freed together by editorFreeRows(); an edit copies a row out, like it
+// does a mapped one.
+char *editorArenaAlloc(size_t len){
+    struct arenaBlock *b = E.arena;
+    if(b == NULL || b->cap - b->used < len){
+        size_t cap = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(*b) + cap);
+        if(b == NULL) die("malloc");
+        b->used = 0;
+        b->cap = cap;
+        // a block made for one large request is filled by it, so smaller
+        // ones keep using the current block
+        if(E.arena && len > ARENA_BLOCK_SIZE / 4){
+            b->next = E.arena->next;
+            E.arena->next = b;
+        }else{
+            b->next = E.arena;
+            E.arena = b;
+        }
+    }
+    char *p = &b->data[b->used];
+    b->used += len;
+    return p;
+}
+
+void editorArenaFree(){
+    while(E.arena){
+        struct arenaBlock *next = E.arena->next;
+        free(E.arena);
+        E.arena = next;
+    }
+}
+
+// A borrowed row takes its text from E.map or E.arena and, like every new
+// row, gets no render or hl until it is displayed, so opening a file costs
+// one erow per line.
+void editorInsertBorrowedRow(int at, char *s, size_t len){
+    erow *row = editorNewRow(at);
+    if(row == NULL) return;
+
+    row->size = len;
+    row->chars = s;
+    row->flags |= ROW_BORROWED;
+}
+
+// Makes room for `need` bytes of chars, first giving a borrowed row its own
+// copy of them.
+void editorRowReserve(erow *row, int need){
+    editorRowClaim(row);
+    if(!(row->flags & ROW_BORROWED)){
+        row->chars = editorRowGrow(row->chars, &row->charscap, need);
+        if(row->flags & ROW_RENDER_ALIAS) row->render = row->chars;
+        return;
+    }
+
+    if(need < row->size + 1) need = row->size + 1;
+    char *chars = editorRowGrow(NULL, &row->charscap, need);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    if(row->flags & ROW_FROZEN) editorRowOrphan(row);
+    row->chars = chars;
+    row->flags &= ~ROW_BORROWED;
+    if(row->flags & ROW_RENDER_ALIAS) row->render = row->chars;
+}
+
+// Gives a borrowed row its own copy of chars before it is modified.
+void editorRowOwn(erow *row){
+    editorRowReserve(row, row->size + 1);
+}
+
+// Brings render and hl of rows [top, bottom) up to date before they are
+// drawn. The multiline comment state is settled by walking forward from
+// E.hl_frontier: a row is re-lexed only if it changed or the state flowing
+// into it did, rows above `top` only get their end state computed, and a
+// state change still spreading at `bottom` is deferred to the next walk
+// rather than chased through the rest of the file.
+void editorHighlightRows(int top, int bottom){
+    if(bottom > E.numrows) bottom = E.numrows;
+
+    int changed = 0;
+    int filerow;
+    for(filerow = E.hl_frontier; filerow < bottom; filerow++){
+        erow *row = editorRowAt(filerow);
+        if(!changed && !(row->flags & ROW_STATE_STALE)) continue;
+
+        int old_state = row->hl_open_comment;
+        if(filerow >= top){
+            editorRowRender(row);
+            editorUpdateSyntax(filerow);
+        }else{
+            int in_comment = filerow > 0 && editorRowAt(filerow - 1)->hl_open_comment;
+            row->hl_open_comment = editorSyntaxEndState(row, in_comment);
+            row->flags &= ~ROW_STATE_STALE;
+            row->flags |= ROW_HL_STALE;
+        }
+        changed = (row->hl_open_comment != old_state);
+    }
+    if(filerow > E.hl_frontier){
+        E.hl_frontier = filerow;
+        if(changed && filerow < E.numrows) editorInvalidateSyntax(filerow);
+    }
+
+    for(filerow = top; filerow < bottom; filerow++){
+        erow *row = editorRowAt(filerow);
+        if(row->flags & ROW_HL_STALE){
+            editorRowRender(row);
+            editorUpdateSyntax(filerow);
+        }
+    }
+}
+
 void editorFreeRow(erow *row){
-    free(row->render);
-    free(row->chars);
+    if(!(row->flags & ROW_RENDER_ALIAS)) free(row->render);
+    if(!(row->flags & ROW_BORROWED)) free(row->chars);
+    if(row->flags & ROW_FROZEN) editorRowOrphan(row);
+    free(row->tabs);
     free(row->hl);
+    editorRowRelease(row);
 }
 
-void editorDelRow(int at){
-    if(at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for(int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-    E.numrows--;
+// Deletes rows [at, at + n) in one move of the gap.
+void editorDelRows(int at, int n){
+    if(at < 0 || n <= 0 || at + n > E.numrows) return;
+    int end_state = editorRowAt(at + n - 1)->hl_open_comment;
+    for(int j = at; j < at + n; j++) editorFreeRow(editorRowAt(j));
+    if(at < E.map_rows) E.map_rows = at;
+    // moving the gap to `at` leaves the doomed rows first after the gap,
+    // so shrinking numrows folds them into the gap
+    editorMoveGap(at);
+    E.numrows -= n;
+    editorDamageRows(at, INT_MAX);
+
+    int prev_state = at > 0 ? editorRowAt(at - 1)->hl_open_comment : 0;
+    if(at < E.numrows && prev_state != end_state) editorInvalidateSyntax(at);
     E.dirty++;
 }
 
-void editorRowInsertChar(erow *row, int at, int c){
+void editorDelRow(int at){
+    editorDelRows(at, 1);
+}
+
+void editorRowInsertChar(int filerow, int at, int c){
+    erow *row = editorRowAt(filerow);
     if(at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
+    editorRowReserve(row, row->size + 2);
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     row->size++;
     row->chars[at] = c;
-    editorUpdateRow(row);
+    editorUpdateRowFrom(filerow, at);
     E.dirty++;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len){
-    row->chars = realloc(row->chars, row->size + len + 1);
+void editorRowAppendString(int filerow, char *s, size_t len){
+    erow *row = editorRowAt(filerow);
+    int at = row->size;
+    editorRowReserve(row, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    editorUpdateRowFrom(filerow, at);
     E.dirty++;
 }
 
-void editorRowDelChar(erow *row, int at){
-    if(at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
+void editorRowDelChars(int filerow, int at, int n){
+    erow *row = editorRowAt(filerow);
+    if(at < 0 || n <= 0 || at + n > row->size) return;
+    editorRowOwn(row);
+    memmove(&row->chars[at], &row->chars[at + n], row->size - at - n + 1);
+    row->size -= n;
+    editorUpdateRowFrom(filerow, at);
     E.dirty++;
 }
 
+void editorRowDelChar(int filerow, int at){
+    editorRowDelChars(filerow, at, 1);
+}
+
 void editorDelChar(){
     if(E.cy == E.numrows) return;
     if(E.cx == 0 && E.cy == 0) return;
+    editorJournalLog(JOURNAL_DEL, NULL, 0);
 
-    erow *row = &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
     if(E.cx > 0 ){
-        editorRowDelChar(row, E.cx -1);
+        editorUndoPush(E.cy, E.cx - 1, &row->chars[E.cx - 1], 1, NULL, 0, 0);
+        editorRowDelChar(E.cy, E.cx -1);
         E.cx--;
     }else{
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        editorUndoPush(E.cy - 1, editorRowAt(E.cy - 1)->size, "\n", 1, NULL, 0, 0);
+        E.cx = editorRowAt(E.cy - 1)->size;
+        editorRowAppendString(E.cy - 1, row->chars, row->size);
         editorDelRow(E.cy);
         E.cy--;
     }
+    editorUndoCursor();
     updateOperation(DELETE);
 }
 
@@ -552,6 +1582,12 @@ void updateOperation(int operation){
         case DELETE:
             E.last_operation = DELETE;
             break;
+        case UNDO:
+            E.last_operation = UNDO;
+            break;
+        case REDO:
+            E.last_operation = REDO;
+            break;
         default:
             E.last_operation = NO_OP;
             break;
@@ -559,174 +1595,2386 @@ void updateOperation(int operation){
 }
 
 void editorInsertChar(int c){
+    char byte = c;
+    editorJournalLog(JOURNAL_CHAR, &byte, 1);
+    // a tab goes in as spaces
+    char spaces[EDITOR_TAB_STOP];
+    memset(spaces, ' ', sizeof(spaces));
+    if(c == '\t') editorUndoPush(E.cy, E.cx, NULL, 0, spaces, sizeof(spaces), E.cy == E.numrows);
+    else editorUndoPush(E.cy, E.cx, NULL, 0, &byte, 1, E.cy == E.numrows);
     if(E.cy == E.numrows){
         editorInsertRow(E.numrows,"", 0);
     }
     if (c == '\t') {
         for (int i = 0; i < EDITOR_TAB_STOP; i++) {
-            editorRowInsertChar(&E.row[E.cy], E.cx, ' ');
+            editorRowInsertChar(E.cy, E.cx, ' ');
             E.cx++;
         }
-    } else {
-        editorRowInsertChar(&E.row[E.cy], E.cx, c);
-        E.cx++;
+    } else {
+        editorRowInsertChar(E.cy, E.cx, c);
+        E.cx++;
+    }
+    editorUndoCursor();
+    updateOperation(INSERT);
+}
+
+void editorInsertNewline(){
+    editorJournalLog(JOURNAL_NEWLINE, NULL, 0);
+    editorUndoPush(E.cy, E.cx, NULL, 0, "\n", 1, 0);
+    if(E.cx == 0){
+        editorInsertRow(E.cy, "", 0);
+    }else{
+        erow *row = editorRowAt(E.cy);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        row = editorRowAt(E.cy);
+        editorRowOwn(row);
+        row->size = E.cx;
+        row->chars[row->size] = '\0';
+        editorUpdateRowFrom(E.cy, E.cx);
+    }
+    E.cy++;
+    E.cx = 0;
+    editorUndoCursor();
+}
+
+// Inserts text at the cursor in one go and leaves the cursor after it.
+// Lines are split in a single pass, each row touched is allocated once,
+// and rows are only re-highlighted when drawn. "\n" ends a line; any other
+// byte, tabs included, is kept as it is. With borrow set the whole lines
+// share one copy in E.arena, which lives as long as the buffer; otherwise
+// each gets a row of its own, freed with the row.
+void editorInsertLines(char *s, size_t len, int borrow){
+    if(len == 0) return;
+    if(E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+
+    char *end = s + len;
+    char *eol = memchr(s, '\n', len);
+    if(eol == NULL) eol = end;
+    int first = eol - s;
+    int cx = E.cx;
+    int taillen = editorRowAt(E.cy)->size - cx;
+
+    if(eol == end){
+        erow *row = editorRowAt(E.cy);
+        editorRowReserve(row, row->size + first + 1);
+        memmove(&row->chars[cx + first], &row->chars[cx], taillen + 1);
+        memcpy(&row->chars[cx], s, first);
+        row->size += first;
+        editorUpdateRowFrom(E.cy, cx);
+        E.dirty++;
+        E.cx += first;
+        return;
+    }
+
+    // the last line takes the text after the cursor along
+    char *last = end;
+    while(last[-1] != '\n') last--;
+    int lastlen = end - last;
+    erow *row = editorNewRow(E.cy + 1);
+    if(row == NULL) return;
+    editorRowClaim(row);
+    row->chars = editorRowGrow(NULL, &row->charscap, lastlen + taillen + 1);
+    memcpy(row->chars, last, lastlen);
+    memcpy(&row->chars[lastlen], &editorRowAt(E.cy)->chars[cx], taillen);
+    row->size = lastlen + taillen;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(E.cy + 1);
+    E.dirty++;
+
+    // the whole lines in between, borrowed from one copy or copied each
+    int at = E.cy + 1;
+    char *line = eol + 1;
+    if(line < last && !borrow){
+        for(char *p = line; p < last; p = eol + 1){
+            eol = memchr(p, '\n', last - p);
+            editorInsertRow(at++, p, eol - p);
+        }
+    }else if(line < last){
+        char *copy = editorArenaAlloc(last - line);
+        memcpy(copy, line, last - line);
+        for(char *p = line; p < last; p = eol + 1){
+            eol = memchr(p, '\n', last - p);
+            editorInsertBorrowedRow(at++, copy + (p - line), eol - p);
+            E.dirty++;
+        }
+    }
+
+    row = editorRowAt(E.cy);
+    editorRowReserve(row, cx + first + 1);
+    memcpy(&row->chars[cx], s, first);
+    row->size = cx + first;
+    row->chars[row->size] = '\0';
+    editorUpdateRowFrom(E.cy, cx);
+    E.dirty++;
+
+    E.cy = at;
+    E.cx = lastlen;
+}
+
+// Inserts pasted text at the cursor as one edit. "\r\n" and "\r" end a
+// line as "\n" does; s is rewritten in place to use "\n" only.
+void editorInsertText(char *s, size_t len){
+    char *w = memchr(s, '\r', len);
+    if(w != NULL){
+        char *end = s + len;
+        for(char *r = w; r < end; r++){
+            if(*r != '\r'){
+                *w++ = *r;
+                continue;
+            }
+            *w++ = '\n';
+            if(r + 1 < end && r[1] == '\n') r++;
+        }
+        len = w - s;
+    }
+    if(len == 0) return;
+    editorJournalLog(JOURNAL_TEXT, s, len);
+    editorUndoPush(E.cy, E.cx, NULL, 0, s, len, E.cy == E.numrows);
+    editorInsertLines(s, len, 1);
+    editorUndoCursor();
+    updateOperation(INSERT);
+}
+
+/*** undo ***/
+
+void editorUndoFree(struct undoRecord *r){
+    E.undo.bytes -= sizeof(*r) + r->cap;
+    free(r->text);
+}
+
+// Drops the whole history, as when another file is opened.
+void editorUndoReset(){
+    struct editorUndo *u = &E.undo;
+    for(int i = 0; i < u->n; i++) editorUndoFree(&u->recs[i]);
+    u->n = u->cur = 0;
+    u->sealed = 0;
+}
+
+// Evicts the oldest records once the history outgrows its limit, down to
+// three quarters of it so that eviction happens in batches. The newest
+// record goes too only if it alone is over the limit.
+void editorUndoTrim(){
+    struct editorUndo *u = &E.undo;
+    if(u->bytes <= u->limit) return;
+    int k = 0;
+    while(k < u->n - 1 && u->bytes > u->limit / 4 * 3) editorUndoFree(&u->recs[k++]);
+    if(u->bytes > u->limit) editorUndoFree(&u->recs[k++]);
+    memmove(u->recs, &u->recs[k], sizeof(struct undoRecord) * (u->n - k));
+    u->n -= k;
+    u->cur = u->cur > k ? u->cur - k : 0;
+}
+
+// Records an edit about to replace rem with ins at (y, x), with eof set if
+// it appends a row at the end of the buffer. A char typed right after the
+// last one joins its record, up to the limit. Whatever was undone can no
+// longer be redone.
+void editorUndoPush(int y, int x, const char *rem, int remlen, const char *ins, int inslen, int eof){
+    struct editorUndo *u = &E.undo;
+    for(int i = u->cur; i < u->n; i++) editorUndoFree(&u->recs[i]);
+    u->n = u->cur;
+
+    int typing = remlen == 0 && !eof && memchr(ins, '\n', inslen) == NULL;
+    struct undoRecord *r = u->n ? &u->recs[u->n - 1] : NULL;
+    if(r && typing && r->typing && !u->sealed && r->y == y && r->x + r->inslen == x &&
+        r->cy[1] == E.cy && r->cx[1] == E.cx){
+        u->bytes -= r->cap;
+        r->text = editorRowGrow(r->text, &r->cap, r->remlen + r->inslen + inslen);
+        u->bytes += r->cap;
+        memcpy(&r->text[r->remlen + r->inslen], ins, inslen);
+        r->inslen += inslen;
+        // a run typed past the limit is cut off where it got there
+        if(sizeof(*r) + r->cap > u->limit) u->sealed = 1;
+        editorUndoTrim();
+        return;
+    }
+
+    u->recs = editorRowGrow(u->recs, &u->reccap, (u->n + 1) * sizeof(struct undoRecord));
+    r = &u->recs[u->n++];
+    u->cur = u->n;
+    u->sealed = 0;
+    r->y = y;
+    r->x = x;
+    r->cy[0] = r->cy[1] = E.cy;
+    r->cx[0] = r->cx[1] = E.cx;
+    r->remlen = remlen;
+    r->inslen = inslen + (eof ? 1 : 0);
+    // sized exactly: only typing grows a record later
+    r->cap = r->remlen + r->inslen;
+    r->text = malloc(r->cap);
+    if(r->text == NULL) die("malloc");
+    if(remlen) memcpy(r->text, rem, remlen);
+    if(inslen) memcpy(&r->text[remlen], ins, inslen);
+    if(eof) r->text[remlen + inslen] = '\n';
+    r->typing = typing;
+    u->bytes += sizeof(*r) + r->cap;
+    editorUndoTrim();
+}
+
+// Notes where the edit just recorded left the cursor, for redo.
+void editorUndoCursor(){
+    struct editorUndo *u = &E.undo;
+    if(u->cur == 0) return;
+    u->recs[u->cur - 1].cy[1] = E.cy;
+    u->recs[u->cur - 1].cx[1] = E.cx;
+}
+
+// Returns 1 if the text at (y, x) reads s[0, len), with "\n" for each row
+// end crossed.
+int editorTextAt(int y, int x, const char *s, int len){
+    const char *end = s + len;
+    while(s < end){
+        if(y >= E.numrows) return 0;
+        erow *row = editorRowAt(y);
+        const char *nl = memchr(s, '\n', end - s);
+        int n = (nl ? nl : end) - s;
+        if(x + n > row->size || memcmp(&row->chars[x], s, n) != 0) return 0;
+        if(nl == NULL) return 1;
+        if(x + n != row->size) return 0;
+        s = nl + 1;
+        y++;
+        x = 0;
+    }
+    return 1;
+}
+
+// Deletes s[0, len) from the text at the cursor, where s is what is there,
+// with "\n" for each row end crossed. Returns -1, changing nothing, if the
+// text there is not s.
+int editorEraseText(const char *s, int len){
+    int y = E.cy, x = E.cx;
+    int lines = 0;
+    const char *last = s;
+    for(const char *p = s; (p = memchr(p, '\n', s + len - p)) != NULL; p++){
+        lines++;
+        last = p + 1;
+    }
+    int ey = y + lines;
+    int ex = (lines ? 0 : x) + (s + len - last);
+    if(y < 0 || x < 0 || ey > E.numrows) return -1;
+    if(y < E.numrows && x > editorRowAt(y)->size) return -1;
+    if(!editorTextAt(y, x, s, len)) return -1;
+
+    if(ey == E.numrows){
+        // only whole rows at the end of the buffer
+        if(x != 0 || ex != 0) return -1;
+        editorDelRows(y, lines);
+        return 0;
+    }
+    if(ex > editorRowAt(ey)->size) return -1;
+    if(lines == 0){
+        editorRowDelChars(y, x, len);
+        return 0;
+    }
+    erow *row = editorRowAt(y);
+    editorRowOwn(row);
+    row->size = x;
+    row->chars[x] = '\0';
+    erow *end = editorRowAt(ey);
+    editorRowAppendString(y, &end->chars[ex], end->size - ex);
+    editorDelRows(y + 1, lines);
+    return 0;
+}
+
+// Inserts s[0, len) into the text at the cursor. At the end of the buffer
+// s ends in the "\n" of the last row it adds. The rows own their text, as
+// the arena is never given back before close and a text can be undone and
+// redone any number of times.
+void editorPutText(char *s, int len){
+    if(len == 0) return;
+    if(E.cy == E.numrows){
+        editorInsertRow(E.numrows, "", 0);
+        len--;
+    }
+    editorInsertLines(s, len, 0);
+}
+
+// Replaces from[0, fromlen) at (y, x) with to[0, tolen), journaled as an
+// erase and a put so that recovery does not depend on the history. Returns
+// -1, changing nothing, if the text at (y, x) is not `from`.
+int editorUndoReplace(int y, int x, const char *from, int fromlen, char *to, int tolen){
+    E.cy = y;
+    E.cx = x;
+    if(fromlen){
+        if(editorEraseText(from, fromlen) == -1) return -1;
+        editorJournalLog(JOURNAL_ERASE, from, fromlen);
+    }
+    if(tolen){
+        editorJournalLog(JOURNAL_PUT, to, tolen);
+        editorPutText(to, tolen);
+    }
+    return 0;
+}
+
+// Drops a history that no longer matches the text rather than apply it.
+void editorUndoLost(){
+    editorUndoReset();
+    editorSetStatusMessage("Undo history lost: it no longer matches the text");
+}
+
+void editorUndo(){
+    struct editorUndo *u = &E.undo;
+    if(u->cur == 0){
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    struct undoRecord *r = &u->recs[u->cur - 1];
+    if(editorUndoReplace(r->y, r->x, &r->text[r->remlen], r->inslen, r->text, r->remlen) == -1){
+        editorUndoLost();
+        return;
+    }
+    u->cur--;
+    E.cy = r->cy[0];
+    E.cx = r->cx[0];
+    u->sealed = 1;
+    updateOperation(UNDO);
+}
+
+void editorRedo(){
+    struct editorUndo *u = &E.undo;
+    if(u->cur == u->n){
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    struct undoRecord *r = &u->recs[u->cur];
+    if(editorUndoReplace(r->y, r->x, r->text, r->remlen, &r->text[r->remlen], r->inslen) == -1){
+        editorUndoLost();
+        return;
+    }
+    u->cur++;
+    E.cy = r->cy[1];
+    E.cx = r->cx[1];
+    u->sealed = 1;
+    updateOperation(REDO);
+}
+
+/*** file i/o ***/
+// Writes all of iov[0, n) to fd, resuming after short writes.
+int editorWritev(int fd, struct iovec *iov, int n){
+    while(n > 0){
+        ssize_t w = writev(fd, iov, n);
+        if(w == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        while(n > 0 && (size_t)w >= iov->iov_len){
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if(n > 0){
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// Makes a rename in the directory of `path` durable.
+void editorSyncDir(const char *path){
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+    if(dir == NULL) return;
+    int fd = open(dir, O_RDONLY);
+    if(fd != -1){
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+// Adds text[0, len) to the snapshot, plus a newline if newline is set.
+// Text carrying its own newline extends the last piece when it follows it
+// in memory, as rows of the mapping and of the arena do.
+void editorSaveAppend(struct saveJob *job, const char *text, int len, int newline){
+    struct savePiece *last = job->npieces ? &job->pieces[job->npieces - 1] : NULL;
+    if(last && !last->newline && last->text + last->len == text && last->len + len <= SAVE_CHUNK){
+        last->len += len;
+        last->newline = newline;
+    }else{
+        job->pieces = editorRowGrow(job->pieces, &job->piececap, (job->npieces + 1) * sizeof(*job->pieces));
+        job->pieces[job->npieces].text = text;
+        job->pieces[job->npieces].len = len;
+        job->pieces[job->npieces].newline = newline;
+        job->npieces++;
+    }
+    job->total += len + newline;
+}
+
+// Takes the snapshot: pieces of every row, each followed by a newline,
+// without copying any text. Rows owning their chars are frozen until the
+// save is done. Rows of the mapping and of the arena are followed by their
+// newline in memory (a mapped last line may not be), so runs of them make
+// one piece.
+void editorSaveSnapshot(struct saveJob *job){
+    for(int j = 0; j < E.numrows; j++){
+        erow *row = editorRowAt(j);
+        if(!(row->flags & ROW_BORROWED)){
+            row->flags |= ROW_BORROWED | ROW_FROZEN;
+            editorSaveAppend(job, row->chars, row->size, 1);
+        }else if(!(row->flags & ROW_FROZEN) &&
+            (!editorRowInMap(row) || row->chars + row->size < E.map + E.mapsize) &&
+            row->chars[row->size] == '\n'){
+            editorSaveAppend(job, row->chars, row->size + 1, 0);
+        }else{
+            editorSaveAppend(job, row->chars, row->size, 1);
+        }
+    }
+}
+
+// Writes the snapshot to a temp file next to the target and renames it over
+// the target, so a crash leaves either file whole.
+void *editorSaveWorker(void *arg){
+    struct saveJob *job = arg;
+    int err = 0;
+    int fd = mkstemp(job->tmp);
+    if(fd == -1) err = errno;
+    if(fd != -1){
+        if(fchmod(fd, job->mode) == -1) err = errno;
+        // the iovecs are built a batch at a time, so the snapshot itself
+        // stays at one small piece per run of rows
+        static char newline = '\n';
+        struct iovec iov[SAVE_IOV_BATCH];
+        for(int i = 0; !err && i < job->npieces; ){
+            int n = 0;
+            long long batch = 0;
+            for(; i < job->npieces && n + 2 <= SAVE_IOV_BATCH; i++){
+                struct savePiece *p = &job->pieces[i];
+                iov[n].iov_base = (char *)p->text;
+                iov[n++].iov_len = p->len;
+                if(p->newline){
+                    iov[n].iov_base = &newline;
+                    iov[n++].iov_len = 1;
+                }
+                batch += p->len + p->newline;
+            }
+            if(editorWritev(fd, iov, n) == -1){
+                err = errno;
+                break;
+            }
+            pthread_mutex_lock(&job->lock);
+            job->written += batch;
+            pthread_mutex_unlock(&job->lock);
+        }
+        if(!err && fsync(fd) == -1) err = errno;
+        if(close(fd) == -1 && !err) err = errno;
+        if(!err && rename(job->tmp, job->target) == -1) err = errno;
+        if(err) unlink(job->tmp);
+        else editorSyncDir(job->target);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->err = err;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    editorWake();
+    return NULL;
+}
+
+// Collects a save whose worker is done, or with `wait` set, waits for it
+// first. Frozen rows get their chars back and the buffer counts as saved up
+// to the snapshot: edits made since keep it dirty.
+void editorSaveFinish(int wait){
+    struct saveJob *job = &E.save;
+    if(!job->active) return;
+
+    pthread_mutex_lock(&job->lock);
+    int done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    if(!done && !wait) return;
+    pthread_join(job->thread, NULL);
+
+    for(int i = 0; i < job->norphans; i++) free(job->orphans[i]);
+    job->norphans = 0;
+    for(int j = 0; j < E.numrows; j++){
+        erow *row = editorRowAt(j);
+        if(row->flags & ROW_FROZEN) row->flags &= ~(ROW_FROZEN | ROW_BORROWED);
+    }
+
+    if(job->err == 0){
+        E.dirty -= job->dirty;
+        if(E.dirty < 0) E.dirty = 0;
+        E.checkpoint[0] = job->cy;
+        E.checkpoint[1] = job->cx;
+        editorSetStatusMessage("%lld bytes written to disk", job->total);
+        editorJournalRebase(job->target);
+    }else{
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    }
+    free(job->pieces);
+    free(job->tmp);
+    free(job->target);
+    job->pieces = NULL;
+    job->npieces = job->piececap = 0;
+    job->active = 0;
+}
+
+void editorSaveStatus(char *buf, size_t size){
+    struct saveJob *job = &E.save;
+    buf[0] = '\0';
+    if(!job->active) return;
+    pthread_mutex_lock(&job->lock);
+    long long written = job->written;
+    pthread_mutex_unlock(&job->lock);
+    snprintf(buf, size, " | saving %d%%", job->total ? (int)(written * 100 / job->total) : 100);
+}
+
+void editorFreeRows(){
+    // a running save still reads the mapping, the arena and frozen rows
+    editorSaveFinish(1);
+    // rows that only borrow go with the mapping and the arena, so only the
+    // ones on E.owned need a visit
+    while(E.nowned) editorFreeRow(&E.row[E.owned[E.nowned - 1]]);
+    if(E.row) free(E.row);
+    if(E.map) munmap(E.map, E.mapsize);
+    editorArenaFree();
+    E.numrows = 0;
+    E.row = NULL;
+    E.rowcap = 0;
+    E.gapstart = 0;
+    E.map = NULL;
+    E.mapsize = 0;
+    E.map_rows = 0;
+    E.hl_frontier = 0;
+    editorDamageRows(0, INT_MAX);
+}
+
+void closeEditor(){
+    editorFreeRows();
+    editorJournalClose(1);
+    editorUndoReset();
+    if(E.filename){
+        free(E.filename);
+        E.filename = NULL;
+    }
+    E.dirty = 0;
+    E.checkpoint[0] = 0;
+    E.checkpoint[1] = 0;
+    E.last_operation = NO_OP;
+    E.syntax = NULL;
+    editorSetStatusMessage("File closing...");
+}
+
+FILE *openFile(char *filename){
+    FILE *fp = fopen(filename, "a+");
+    if(!fp) die("fopen");
+    return fp;
+}
+
+#if defined(__SSE2__)
+// editorCountNewlines() for whole 32-byte blocks of p[0, n). Returns the
+// count and stores in *at where the blocks end.
+TARGET_AVX2
+size_t editorCountNewlinesAVX2(const char *p, size_t n, size_t *at){
+    size_t count = 0, i = 0;
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    while(i + 32 <= n){
+        __m256i acc = zero;
+        for(int k = 0; k < 255 && i + 32 <= n; k++, i += 32){
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        __m256i sum = _mm256_sad_epu8(acc, zero);
+        count += _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+            _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+    }
+    *at = i;
+    return count;
+}
+#endif
+
+// Returns the number of '\n' in p[0, n). Compare results are summed per
+// byte lane, at most 255 vectors at a time, then folded with a SAD.
+size_t editorCountNewlines(const char *p, size_t n){
+    size_t count = 0, i = 0;
+#if defined(__SSE2__)
+    if(CPU_HAS_AVX2()) count = editorCountNewlinesAVX2(p, n, &i);
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    while(i + 16 <= n){
+        __m128i acc = zero;
+        for(int k = 0; k < 255 && i + 16 <= n; k++, i += 16){
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        __m128i sum = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    }
+#endif
+    for(; i < n; i++) count += p[i] == '\n';
+    return count;
+}
+
+void *editorLoadCount(void *arg){
+    struct loadJob *job = arg;
+    job->nrows = editorCountNewlines(job->from, job->to - job->from);
+    // the last line of a file need not end in a newline
+    if(job->to > job->from && job->to[-1] != '\n') job->nrows++;
+    return NULL;
+}
+
+// Points row at s[0, len), a line of the mapping, as a fresh row would be.
+// Trailing '\r's are dropped, as openEditor() does for a file it reads.
+void editorLoadRow(erow *row, const char *s, size_t len){
+    while(len > 0 && s[len - 1] == '\r') len--;
+    *row = (erow){
+        .size = len,
+        .chars = (char *)s,
+        .flags = ROW_BORROWED | ROW_RENDER_STALE | ROW_HL_STALE | ROW_STATE_STALE
+    };
+}
+
+#if defined(__SSE2__)
+// editorLoadFill() for whole 32-byte blocks of p[0, n), from the line
+// starting at *line on. Returns the next row to fill and stores in *at
+// where the blocks end.
+TARGET_AVX2
+erow *editorLoadFillAVX2(const char *p, size_t n, size_t *at, const char **line, erow *row){
+    size_t i = 0;
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for(; i + 32 <= n; i += 32){
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        while(mask){
+            const char *eol = p + i + __builtin_ctz(mask);
+            editorLoadRow(row++, *line, eol - *line);
+            *line = eol + 1;
+            mask &= mask - 1;
+        }
+    }
+    *at = i;
+    return row;
+}
+#endif
+
+void *editorLoadFill(void *arg){
+    struct loadJob *job = arg;
+    const char *p = job->from;
+    size_t n = job->to - job->from;
+    const char *line = p;
+    erow *row = job->rows;
+    size_t i = 0;
+#if defined(__SSE2__)
+    if(CPU_HAS_AVX2()) row = editorLoadFillAVX2(p, n, &i, &line, row);
+    const __m128i nl = _mm_set1_epi8('\n');
+    for(; i + 16 <= n; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while(mask){
+            const char *eol = p + i + __builtin_ctz(mask);
+            editorLoadRow(row++, line, eol - line);
+            line = eol + 1;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for(; i < n; i++){
+        if(p[i] != '\n') continue;
+        editorLoadRow(row++, line, p + i - line);
+        line = p + i + 1;
+    }
+    if(line < job->to) editorLoadRow(row, line, job->to - line);
+    return NULL;
+}
+
+// Runs fn on every job, each on a thread of its own when there are several.
+void editorLoadRun(struct loadJob *jobs, int njobs, void *(*fn)(void *)){
+    for(int j = 0; j < njobs; j++){
+        jobs[j].joinable = njobs > 1 && pthread_create(&jobs[j].thread, NULL, fn, &jobs[j]) == 0;
+        // no thread to spare: do the share right here
+        if(!jobs[j].joinable) fn(&jobs[j]);
+    }
+    for(int j = 0; j < njobs; j++){
+        if(jobs[j].joinable) pthread_join(jobs[j].thread, NULL);
+    }
+}
+
+// Returns how many threads index a file of `size` bytes.
+int editorLoadJobs(size_t size){
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t njobs = size / LOAD_BYTES_PER_JOB + 1;
+    if(ncpu > 0 && njobs > (size_t)ncpu) njobs = ncpu;
+    if(njobs > LOAD_MAX_JOBS) njobs = LOAD_MAX_JOBS;
+    return njobs;
+}
+
+// Splits the mapped file into rows without copying any of it. The file is
+// cut into one share per thread at line starts; the threads count the
+// lines of their share, then, once the row array is allocated, point the
+// rows of their share at the mapping.
+void editorLoadMap(){
+    struct loadJob jobs[LOAD_MAX_JOBS];
+    int njobs = editorLoadJobs(E.mapsize);
+    const char *end = E.map + E.mapsize;
+    const char *p = E.map;
+    for(int j = 0; j < njobs; j++){
+        jobs[j].from = p;
+        jobs[j].to = end;
+        if(j < njobs - 1){
+            const char *cut = E.map + E.mapsize / njobs * (j + 1);
+            if(cut < p) cut = p;
+            const char *nl = memchr(cut, '\n', end - cut);
+            if(nl) jobs[j].to = nl + 1;
+        }
+        p = jobs[j].to;
+    }
+
+    editorLoadRun(jobs, njobs, editorLoadCount);
+    long total = 0;
+    for(int j = 0; j < njobs; j++) total += jobs[j].nrows;
+    if(total > INT_MAX){
+        errno = EFBIG;
+        die("editorLoadMap");
+    }
+    erow *rows = malloc(sizeof(erow) * (total ? total : 1));
+    if(rows == NULL) die("malloc");
+    for(int j = 0, at = 0; j < njobs; j++){
+        jobs[j].rows = rows + at;
+        at += jobs[j].nrows;
+    }
+    editorLoadRun(jobs, njobs, editorLoadFill);
+
+    // the rows fill the array, with the gap empty at its end
+    E.row = rows;
+    E.rowcap = E.numrows = E.gapstart = total;
+    E.map_rows = total;
+    E.hl_frontier = 0;
+    editorDamageRows(0, INT_MAX);
+}
+
+void openEditor(char *filename){
+    editorFreeRows();
+    editorJournalClose(0);
+    editorUndoReset();
+    free(E.filename);
+    E.cx = E.cy = 0;
+    E.rowoffset = E.coloffset = 0;
+
+    if(filename == NULL){
+        E.filename = NULL;
+        return;
+    }
+
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHiglight();
+
+    FILE *fp = openFile(filename);
+    if(!fp) die("fopen");
+
+    struct stat st;
+    if(fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if(map != MAP_FAILED){
+            E.map = map;
+            E.mapsize = st.st_size;
+            editorLoadMap();
+        }
+    }
+
+    if(E.map == NULL){
+        char *line = NULL;
+        size_t linecap = 0;
+        ssize_t linelen;
+        while((linelen = getline(&line, &linecap, fp)) != -1){
+            while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')){
+                linelen--;
+            }
+            // the newline after the text lets a save write a run of
+            // these rows as one piece
+            char *chars = editorArenaAlloc(linelen + 1);
+            memcpy(chars, line, linelen);
+            chars[linelen] = '\n';
+            editorInsertBorrowedRow(E.numrows, chars, linelen);
+        }
+        free(line);
+    }
+    fclose(fp);
+    E.checkpoint[0] = E.cy;
+    E.checkpoint[1] = E.cx;
+
+    E.dirty = 0;
+    editorJournalOpen();
+}
+
+void openEditorCallback(char *filename, int key){
+    if(key == '\r'){
+        openEditor(filename);
+    } else if(key == '\x1b'){
+        editorSetStatusMessage("");
+    }
+}
+
+void editorSave(){
+    updateOperation(SAVE);
+    if(E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if(E.filename == NULL){
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHiglight();
+    }
+
+    // one save at a time: a new one starts from the end of the last
+    editorSaveFinish(1);
+
+    struct saveJob *job = &E.save;
+    job->target = realpath(E.filename, NULL);
+    if(job->target == NULL) job->target = strdup(E.filename);
+    if(job->target == NULL) die("strdup");
+    job->tmp = malloc(strlen(job->target) + 8);
+    if(job->tmp == NULL) die("malloc");
+    sprintf(job->tmp, "%s.XXXXXX", job->target);
+
+    struct stat st;
+    if(stat(job->target, &st) == 0){
+        job->mode = st.st_mode & 07777;
+    }else{
+        mode_t mask = umask(0);
+        umask(mask);
+        job->mode = 0644 & ~mask;
+    }
+
+    job->total = 0;
+    editorSaveSnapshot(job);
+    job->dirty = E.dirty;
+    E.journal.mark = E.journal.size + E.journal.pending.len;
+    job->cy = E.cy;
+    job->cx = E.cx;
+    job->written = 0;
+    job->done = 0;
+    job->err = 0;
+    if(pthread_create(&job->thread, NULL, editorSaveWorker, job) != 0) die("pthread_create");
+    job->active = 1;
+}
+
+/*** journal ***/
+
+// Returns the journal path for the file at `target`: a hidden file next to it.
+char *editorJournalPath(const char *target){
+    const char *base = strrchr(target, '/');
+    int dirlen = base ? base - target + 1 : 0;
+    base = base ? base + 1 : target;
+    char *path = malloc(dirlen + strlen(base) + 6);
+    if(path == NULL) die("malloc");
+    sprintf(path, "%.*s.%s.bxj", dirlen, target, base);
+    return path;
+}
+
+void editorJournalHeader(struct journalHeader *h, struct stat *st){
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+    h->size = st->st_size;
+    h->mtime = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->ino = st->st_ino;
+}
+
+// Stops journaling after an I/O error. Editing goes on; what was synced
+// stays on disk.
+void editorJournalFail(int err){
+    struct editorJournal *j = &E.journal;
+    editorSetStatusMessage("Journal off! I/O error: %s", strerror(err));
+    close(j->fd);
+    free(j->path);
+    j->path = NULL;
+    abReset(&j->pending);
+    j->unsynced = 0;
+    editorClearTimer(TIMER_JOURNAL);
+}
+
+// Writes the buffered records, followed by s[0, len), to the journal.
+void editorJournalWrite(const char *s, int len){
+    struct editorJournal *j = &E.journal;
+    if(j->path == NULL || j->pending.len + len == 0) return;
+    struct iovec iov[2] = {{j->pending.b, j->pending.len}, {(char *)s, len}};
+    if(editorWritev(j->fd, iov, 2) == -1){
+        editorJournalFail(errno);
+        return;
+    }
+    j->size += j->pending.len + len;
+    abReset(&j->pending);
+}
+
+// Logs an edit about to be made at the cursor: the op as a byte and the
+// cursor as two ints, then for JOURNAL_CHAR the byte and for the ops with
+// text the length and the text. Nothing touches the disk here; the timer
+// writes and syncs every record since the last sync in one go.
+void editorJournalLog(int op, const char *s, int len){
+    struct editorJournal *j = &E.journal;
+    if(j->path == NULL) return;
+    char rec[1 + 3 * sizeof(int)];
+    int n = 0;
+    rec[n++] = op;
+    memcpy(&rec[n], &E.cy, sizeof(int));
+    n += sizeof(int);
+    memcpy(&rec[n], &E.cx, sizeof(int));
+    n += sizeof(int);
+    if(op != JOURNAL_CHAR && op != JOURNAL_DEL && op != JOURNAL_NEWLINE){
+        memcpy(&rec[n], &len, sizeof(int));
+        n += sizeof(int);
+    }
+    abAppend(&j->pending, rec, n);
+    // big text goes straight from the caller to the file, not via pending
+    if(j->pending.len + len >= JOURNAL_FLUSH_BYTES) editorJournalWrite(s, len);
+    else if(len) abAppend(&j->pending, s, len);
+
+    long long now = editorNow();
+    if(!j->unsynced){
+        j->unsynced = 1;
+        j->first = now;
+    }
+    long long deadline = now + JOURNAL_IDLE_MS;
+    if(deadline > j->first + JOURNAL_MAX_DELAY_MS) deadline = j->first + JOURNAL_MAX_DELAY_MS;
+    E.input.deadline[TIMER_JOURNAL] = deadline;
+}
+
+int editorOnMainThread(){
+    return pthread_equal(pthread_self(), E.main_thread);
+}
+
+// Makes every logged edit durable.
+void editorJournalSync(){
+    struct editorJournal *j = &E.journal;
+    editorClearTimer(TIMER_JOURNAL);
+    if(j->path == NULL || !j->unsynced) return;
+    editorJournalWrite(NULL, 0);
+    if(j->path && fsync(j->fd) == -1) editorJournalFail(errno);
+    j->unsynced = 0;
+}
+
+// Applies the records in buf[0, len) to the rows just loaded and returns
+// how many bytes of them held whole, valid records. A record torn by a
+// crash or one that does not fit the text ends the replay.
+size_t editorJournalReplay(const char *buf, size_t len, int *edits){
+    const char *p = buf;
+    const char *end = buf + len;
+    const size_t head = 1 + 2 * sizeof(int);
+    while((size_t)(end - p) >= head){
+        int op = (unsigned char)p[0];
+        int cy, cx, arglen = 0;
+        memcpy(&cy, p + 1, sizeof(int));
+        memcpy(&cx, p + 1 + sizeof(int), sizeof(int));
+        const char *arg = p + head;
+        if(op == JOURNAL_CHAR){
+            arglen = 1;
+        }else if(op == JOURNAL_TEXT || op == JOURNAL_ERASE || op == JOURNAL_PUT){
+            if((size_t)(end - arg) < sizeof(int)) break;
+            memcpy(&arglen, arg, sizeof(int));
+            arg += sizeof(int);
+            if(arglen < 0) break;
+        }else if(op != JOURNAL_DEL && op != JOURNAL_NEWLINE){
+            break;
+        }
+        if(end - arg < arglen) break;
+        if(cy < 0 || cy > E.numrows) break;
+        if(cx < 0 || cx > (cy < E.numrows ? editorRowAt(cy)->size : 0)) break;
+
+        E.cy = cy;
+        E.cx = cx;
+        switch(op){
+            case JOURNAL_CHAR: editorInsertChar((unsigned char)arg[0]); break;
+            case JOURNAL_DEL: editorDelChar(); break;
+            case JOURNAL_NEWLINE: editorInsertNewline(); break;
+            case JOURNAL_TEXT: editorInsertText((char *)arg, arglen); break;
+            case JOURNAL_PUT: editorPutText((char *)arg, arglen); break;
+            case JOURNAL_ERASE: if(editorEraseText(arg, arglen) == -1) return p - buf; break;
+        }
+        (*edits)++;
+        p = arg + arglen;
+    }
+    return p - buf;
+}
+
+// Opens the journal of the file just loaded. If it was written against the
+// file as it is on disk, its edits are replayed and it goes on from there;
+// otherwise it starts over empty.
+void editorJournalOpen(){
+    struct editorJournal *j = &E.journal;
+    char *target = realpath(E.filename, NULL);
+    if(target == NULL) return;
+    struct stat st;
+    if(stat(target, &st) == -1){
+        free(target);
+        return;
+    }
+    char *path = editorJournalPath(target);
+    free(target);
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(fd == -1){
+        free(path);
+        return;
+    }
+
+    struct journalHeader want, have;
+    editorJournalHeader(&want, &st);
+    size_t keep = 0;
+    int edits = 0;
+    struct stat jst;
+    if(fstat(fd, &jst) == 0 && (size_t)jst.st_size > sizeof(have)){
+        size_t len = jst.st_size;
+        char *buf = malloc(len);
+        if(buf == NULL) die("malloc");
+        size_t got = 0;
+        ssize_t n;
+        while(got < len && (n = pread(fd, buf + got, len - got, got)) > 0) got += n;
+        memcpy(&have, buf, sizeof(have));
+        if(got == len && memcmp(&have, &want, sizeof(have)) == 0){
+            keep = sizeof(have) + editorJournalReplay(buf + sizeof(have), len - sizeof(have), &edits);
+        }
+        free(buf);
+    }
+
+    // a torn tail is cut off so that new records follow the last whole one
+    if(keep == 0){
+        if(ftruncate(fd, 0) == -1 || pwrite(fd, &want, sizeof(want), 0) != sizeof(want) || fsync(fd) == -1){
+            close(fd);
+            free(path);
+            return;
+        }
+        editorSyncDir(path);
+        keep = sizeof(want);
+    }else if(ftruncate(fd, keep) == -1){
+        close(fd);
+        free(path);
+        return;
+    }
+    lseek(fd, keep, SEEK_SET);
+
+    j->path = path;
+    j->fd = fd;
+    j->size = keep;
+    abReset(&j->pending);
+    j->unsynced = 0;
+    if(edits){
+        // undo and redo replay without the history, so it is out of step
+        editorUndoReset();
+        editorSetStatusMessage("Recovered %d unsaved edits from %s", edits, path);
+    }
+}
+
+// Closes the journal. It is deleted with `discard` set or when the buffer
+// has nothing unsaved; otherwise it is synced and kept for the next open.
+void editorJournalClose(int discard){
+    struct editorJournal *j = &E.journal;
+    if(j->path == NULL) return;
+    if(discard || E.dirty == 0){
+        unlink(j->path);
+    }else{
+        editorJournalSync();
+        if(j->path == NULL) return;
+    }
+    close(j->fd);
+    free(j->path);
+    j->path = NULL;
+    abReset(&j->pending);
+    j->unsynced = 0;
+    editorClearTimer(TIMER_JOURNAL);
+}
+
+// Starts the journal over against the file a save just wrote to `target`,
+// carrying along the records of edits made after the save's snapshot.
+void editorJournalRebase(const char *target){
+    struct editorJournal *j = &E.journal;
+    struct stat st;
+    if(stat(target, &st) == -1) return;
+    editorJournalWrite(NULL, 0);
+
+    char *path = editorJournalPath(target);
+    char *tmp = malloc(strlen(path) + 8);
+    if(tmp == NULL) die("malloc");
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    int err = fd == -1 ? errno : 0;
+
+    struct journalHeader h;
+    editorJournalHeader(&h, &st);
+    long long size = sizeof(h);
+    if(!err && write(fd, &h, sizeof(h)) != sizeof(h)) err = errno ? errno : EIO;
+    for(long long off = j->mark; !err && j->path && off < j->size; ){
+        char buf[65536];
+        ssize_t n = pread(j->fd, buf, j->size - off < (long long)sizeof(buf) ? j->size - off : (long long)sizeof(buf), off);
+        if(n <= 0 || write(fd, buf, n) != n) err = errno ? errno : EIO;
+        off += n;
+        size += n;
+    }
+    if(!err && fsync(fd) == -1) err = errno;
+    if(!err && rename(tmp, path) == -1) err = errno;
+    if(err){
+        if(fd != -1){
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        free(path);
+        editorSetStatusMessage("Journal off! I/O error: %s", strerror(err));
+        editorJournalClose(0);
+        return;
+    }
+    free(tmp);
+    editorSyncDir(path);
+
+    if(j->path){
+        // a save under a new name leaves the old file's journal behind
+        if(strcmp(j->path, path) != 0) unlink(j->path);
+        close(j->fd);
+        free(j->path);
+    }
+    j->path = path;
+    j->fd = fd;
+    j->size = size;
+    j->unsynced = 0;
+    editorClearTimer(TIMER_JOURNAL);
+}
+
+/*** regex ***/
+
+// Patterns are parsed into a small syntax tree and compiled into two
+// Thompson NFAs, one for the pattern and one for its reversal. Matching
+// runs DFAs that are built lazily from those NFAs, one transition at a
+// time as the text needs it, so a scan is linear in the text whatever the
+// pattern. Supported: literals, '.', [...] and [^...] classes, \d \w \s
+// and their negations, grouping, '|', '*', '+', '?', and '^' / '$' at the
+// very start / end of the pattern. Nothing matches '\n', so a match never
+// runs from one row into the next.
+
+enum rxNodeType{
+    RX_SET,
+    RX_CONCAT,
+    RX_ALT,
+    RX_STAR,
+    RX_PLUS,
+    RX_QUEST,
+    RX_EMPTY
+};
+
+struct rxNode{
+    int type;
+    int a, b; // children
+    int set; // RX_SET only
+};
+
+enum rxStateType{
+    RXS_SET,
+    RXS_SPLIT,
+    RXS_MATCH
+};
+
+struct rxState{
+    int type;
+    int out, out1;
+    int set;
+};
+
+struct rxProg{
+    struct rxState *states;
+    int nstates;
+    int cap;
+    int start;
+};
+
+struct regex{
+    struct rxNode *nodes;
+    int nnodes, nodecap;
+    unsigned char (*sets)[32]; // byte bitmaps
+    int nsets, setcap;
+    struct rxProg fwd, rev;
+    int bol, eol; // pattern was anchored with ^ / $
+    char literal[RX_MAX_LITERAL + 1]; // bytes every match contains
+    int litlen;
+};
+
+struct rxParser{
+    struct regex *re;
+    const char *p;
+    const char *end;
+    int error;
+};
+
+// A DFA over one NFA program, filled in as transitions are first taken.
+// Its states are sets of NFA states; the cache is flushed when it reaches
+// RX_MAX_DFA_STATES so memory stays bounded on hostile patterns.
+struct rxDFA{
+    const struct regex *re;
+    const struct rxProg *prog;
+    int unanchored; // re-enter the start state at every byte
+    int nstates, statecap;
+    int *trans; // 256 per state: next state << 1 | accepting, -1 = not built yet
+    unsigned char *accept;
+    int *setstart, *setlen;
+    int *pool; // NFA state sets of all DFA states
+    int poolsize, poolcap;
+    int *hash; // DFA state + 1 per slot, 0 = empty
+    int start;
+    int flushes;
+    int *mark, gen, *stack, *buf; // epsilon closure scratch
+};
+
+// What a longest-match scan saw at one column of the line: the DFA state
+// after its byte, and the end of the last match the scan went on to find
+// from there, or -1.
+struct rxMemo{
+    int gen;
+    int state;
+    int end;
+};
+
+// Everything one thread needs to run searches for a compiled regex.
+struct regexMatcher{
+    const struct regex *re;
+    struct rxDFA filter; // forward, unanchored: where does a match end?
+    struct rxDFA starts; // reversed: where can a match start?
+    struct rxDFA longest; // forward, anchored: how far does a match reach?
+    unsigned char first[3]; // the bytes a match can start with, if this few
+    int nfirst;
+    unsigned char *marks; // where matches of the line marks_s start
+    int markcap;
+    const char *marks_s;
+    int marks_len;
+    struct rxMemo *memo; // per column of the line, valid where gen is memogen
+    int memocap;
+    int memogen;
+    int memo_flushes; // longest.flushes the states in memo belong to
+};
+
+void *rxGrow(void *p, int *cap, int need, size_t elem){
+    if(need <= *cap) return p;
+    int newcap = *cap ? *cap : 16;
+    while(newcap < need) newcap *= 2;
+    p = realloc(p, newcap * elem);
+    if(p == NULL) die("realloc");
+    *cap = newcap;
+    return p;
+}
+
+int rxNewNode(struct regex *re, int type, int a, int b, int set){
+    re->nodes = rxGrow(re->nodes, &re->nodecap, re->nnodes + 1, sizeof(struct rxNode));
+    struct rxNode *n = &re->nodes[re->nnodes];
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    n->set = set;
+    return re->nnodes++;
+}
+
+int rxNewSet(struct regex *re){
+    re->sets = rxGrow(re->sets, &re->setcap, re->nsets + 1, sizeof(re->sets[0]));
+    memset(re->sets[re->nsets], 0, sizeof(re->sets[0]));
+    return re->nsets++;
+}
+
+void rxSetAdd(unsigned char *set, int c){
+    set[(unsigned char)c >> 3] |= 1 << (c & 7);
+}
+
+int rxSetHas(const unsigned char *set, int c){
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+// Adds the class named by the escape letter e (d, w, s or a capital for
+// the negation) to set, returning 0 if e names no class.
+int rxSetAddClass(unsigned char *set, int e){
+    unsigned char class[32] = {0};
+    int c;
+    switch(tolower(e)){
+        case 'd':
+            for(c = '0'; c <= '9'; c++) rxSetAdd(class, c);
+            break;
+        case 'w':
+            for(c = 0; c < 256; c++) if(isalnum(c) || c == '_') rxSetAdd(class, c);
+            break;
+        case 's':
+            for(c = 0; c < 256; c++) if(isspace(c)) rxSetAdd(class, c);
+            break;
+        default:
+            return 0;
+    }
+    for(c = 0; c < 32; c++) set[c] |= isupper(e) ? ~class[c] : class[c];
+    return 1;
+}
+
+int rxEscapeChar(int e){
+    return e == 't' ? '\t' : e;
+}
+
+int rxParseAlt(struct rxParser *ps);
+
+int rxParseClass(struct rxParser *ps){
+    struct regex *re = ps->re;
+    int set = rxNewSet(re);
+    int negate = 0;
+    if(ps->p < ps->end && *ps->p == '^'){
+        negate = 1;
+        ps->p++;
+    }
+
+    int first = 1;
+    while(ps->p < ps->end && (*ps->p != ']' || first)){
+        first = 0;
+        int lo = (unsigned char)*ps->p++;
+        if(lo == '\\' && ps->p < ps->end){
+            int e = (unsigned char)*ps->p++;
+            if(rxSetAddClass(re->sets[set], e)) continue;
+            lo = rxEscapeChar(e);
+        }
+        int hi = lo;
+        if(ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']'){
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if(hi == '\\' && ps->p < ps->end) hi = rxEscapeChar((unsigned char)*ps->p++);
+        }
+        for(int c = lo; c <= hi; c++) rxSetAdd(re->sets[set], c);
+    }
+    if(ps->p == ps->end){
+        ps->error = 1;
+        return -1;
+    }
+    ps->p++;
+
+    if(negate){
+        for(int c = 0; c < 32; c++) re->sets[set][c] = ~re->sets[set][c];
+    }
+    return set;
+}
+
+int rxParseAtom(struct rxParser *ps){
+    struct regex *re = ps->re;
+    int c = (unsigned char)*ps->p++;
+    int set;
+
+    switch(c){
+        case '(': {
+            int node = rxParseAlt(ps);
+            if(ps->error) return -1;
+            if(ps->p == ps->end || *ps->p != ')'){
+                ps->error = 1;
+                return -1;
+            }
+            ps->p++;
+            return node;
+        }
+        case '[':
+            set = rxParseClass(ps);
+            if(set == -1) return -1;
+            break;
+        case '.':
+            set = rxNewSet(re);
+            memset(re->sets[set], 0xff, sizeof(re->sets[0]));
+            break;
+        case '*': case '+': case '?':
+            ps->error = 1;
+            return -1;
+        case '\\':
+            set = rxNewSet(re);
+            if(ps->p == ps->end){
+                rxSetAdd(re->sets[set], '\\');
+                break;
+            }
+            c = (unsigned char)*ps->p++;
+            if(!rxSetAddClass(re->sets[set], c)) rxSetAdd(re->sets[set], rxEscapeChar(c));
+            break;
+        default:
+            set = rxNewSet(re);
+            rxSetAdd(re->sets[set], c);
+            break;
+    }
+    // rows never contain a newline, but chunks of rows do
+    re->sets[set]['\n' >> 3] &= ~(1 << ('\n' & 7));
+    return rxNewNode(re, RX_SET, -1, -1, set);
+}
+
+int rxParseRepeat(struct rxParser *ps){
+    int node = rxParseAtom(ps);
+    while(!ps->error && ps->p < ps->end && strchr("*+?", *ps->p)){
+        int type = *ps->p == '*' ? RX_STAR : *ps->p == '+' ? RX_PLUS : RX_QUEST;
+        node = rxNewNode(ps->re, type, node, -1, -1);
+        ps->p++;
+    }
+    return node;
+}
+
+int rxParseConcat(struct rxParser *ps){
+    int node = -1;
+    while(!ps->error && ps->p < ps->end && *ps->p != '|' && *ps->p != ')'){
+        int next = rxParseRepeat(ps);
+        node = node == -1 ? next : rxNewNode(ps->re, RX_CONCAT, node, next, -1);
+    }
+    return node == -1 ? rxNewNode(ps->re, RX_EMPTY, -1, -1, -1) : node;
+}
+
+int rxParseAlt(struct rxParser *ps){
+    int node = rxParseConcat(ps);
+    while(!ps->error && ps->p < ps->end && *ps->p == '|'){
+        ps->p++;
+        int right = rxParseConcat(ps);
+        node = rxNewNode(ps->re, RX_ALT, node, right, -1);
+    }
+    return node;
+}
+
+int rxAddState(struct rxProg *pr, int type, int out, int out1, int set){
+    pr->states = rxGrow(pr->states, &pr->cap, pr->nstates + 1, sizeof(struct rxState));
+    struct rxState *st = &pr->states[pr->nstates];
+    st->type = type;
+    st->out = out;
+    st->out1 = out1;
+    st->set = set;
+    return pr->nstates++;
+}
+
+// Compiles `node` so that it continues into state `next`, returning the
+// state to enter it by. `reverse` builds the NFA of the reversed pattern.
+int rxCompile(struct regex *re, struct rxProg *pr, int node, int next, int reverse){
+    struct rxNode n = re->nodes[node];
+    int s, body;
+
+    switch(n.type){
+        case RX_SET:
+            return rxAddState(pr, RXS_SET, next, -1, n.set);
+        case RX_CONCAT:
+            if(reverse) return rxCompile(re, pr, n.b, rxCompile(re, pr, n.a, next, reverse), reverse);
+            return rxCompile(re, pr, n.a, rxCompile(re, pr, n.b, next, reverse), reverse);
+        case RX_ALT:
+            s = rxCompile(re, pr, n.a, next, reverse);
+            return rxAddState(pr, RXS_SPLIT, s, rxCompile(re, pr, n.b, next, reverse), -1);
+        case RX_STAR:
+            s = rxAddState(pr, RXS_SPLIT, -1, next, -1);
+            body = rxCompile(re, pr, n.a, s, reverse);
+            pr->states[s].out = body;
+            return s;
+        case RX_PLUS:
+            s = rxAddState(pr, RXS_SPLIT, -1, next, -1);
+            body = rxCompile(re, pr, n.a, s, reverse);
+            pr->states[s].out = body;
+            return body;
+        case RX_QUEST:
+            return rxAddState(pr, RXS_SPLIT, rxCompile(re, pr, n.a, next, reverse), next, -1);
+        default:
+            return next;
+    }
+}
+
+// Returns the byte if set holds exactly one, else -1.
+int rxSetSingle(const unsigned char *set){
+    int c = -1;
+    for(int i = 0; i < 256; i++){
+        if(!rxSetHas(set, i)) continue;
+        if(c != -1) return -1;
+        c = i;
+    }
+    return c;
+}
+
+// Finds the longest run of single bytes in the top-level concatenation,
+// a string every match must contain. Searches skip ahead to it with
+// editorSearchMem() and only run the DFAs on rows that have it.
+void rxRequiredLiteral(struct regex *re, int node, char *run, int *runlen){
+    struct rxNode *n = &re->nodes[node];
+    if(n->type == RX_EMPTY) return;
+    if(n->type == RX_CONCAT){
+        rxRequiredLiteral(re, n->a, run, runlen);
+        rxRequiredLiteral(re, n->b, run, runlen);
+        return;
+    }
+
+    int c = n->type == RX_SET ? rxSetSingle(re->sets[n->set]) : -1;
+    if(c == -1 || *runlen == RX_MAX_LITERAL){
+        *runlen = 0;
+        return;
+    }
+    run[(*runlen)++] = c;
+    if(*runlen > re->litlen){
+        memcpy(re->literal, run, *runlen);
+        re->litlen = *runlen;
+    }
+}
+
+void regexFree(struct regex *re){
+    if(re == NULL) return;
+    free(re->nodes);
+    free(re->sets);
+    free(re->fwd.states);
+    free(re->rev.states);
+    free(re);
+}
+
+// Returns NULL if the pattern does not parse or is over RX_MAX_PATTERN
+// bytes: parsing and compiling recurse about once per byte.
+struct regex *regexCompile(const char *pattern){
+    size_t len = strlen(pattern);
+    if(len > RX_MAX_PATTERN) return NULL;
+    struct regex *re = calloc(1, sizeof(struct regex));
+    if(re == NULL) die("calloc");
+
+    if(len && pattern[0] == '^'){
+        re->bol = 1;
+        pattern++;
+        len--;
+    }
+    if(len && pattern[len - 1] == '$'){
+        size_t slashes = 0;
+        while(slashes < len - 1 && pattern[len - 2 - slashes] == '\\') slashes++;
+        if(slashes % 2 == 0){
+            re->eol = 1;
+            len--;
+        }
+    }
+
+    struct rxParser ps = {re, pattern, pattern + len, 0};
+    int root = rxParseAlt(&ps);
+    if(ps.error || ps.p != ps.end){
+        regexFree(re);
+        return NULL;
+    }
+
+    char run[RX_MAX_LITERAL];
+    int runlen = 0;
+    rxRequiredLiteral(re, root, run, &runlen);
+    re->literal[re->litlen] = '\0';
+
+    int match = rxAddState(&re->fwd, RXS_MATCH, -1, -1, -1);
+    re->fwd.start = rxCompile(re, &re->fwd, root, match, 0);
+    match = rxAddState(&re->rev, RXS_MATCH, -1, -1, -1);
+    re->rev.start = rxCompile(re, &re->rev, root, match, 1);
+    return re;
+}
+
+void rxDFAInit(struct rxDFA *d, const struct regex *re, const struct rxProg *prog, int unanchored){
+    memset(d, 0, sizeof(*d));
+    d->re = re;
+    d->prog = prog;
+    d->unanchored = unanchored;
+    d->start = -1;
+    d->hash = calloc(RX_MAX_DFA_STATES * 2, sizeof(int));
+    d->mark = calloc(prog->nstates, sizeof(int));
+    d->stack = malloc(sizeof(int) * (prog->nstates * 2 + 2));
+    d->buf = malloc(sizeof(int) * prog->nstates);
+    if(!d->hash || !d->mark || !d->stack || !d->buf) die("malloc");
+}
+
+void rxDFAFree(struct rxDFA *d){
+    free(d->trans);
+    free(d->accept);
+    free(d->setstart);
+    free(d->setlen);
+    free(d->pool);
+    free(d->hash);
+    free(d->mark);
+    free(d->stack);
+    free(d->buf);
+}
+
+// Adds the epsilon closure of NFA state s to d->buf.
+void rxClosure(struct rxDFA *d, int s, int *n){
+    int top = 0;
+    d->stack[top++] = s;
+    while(top){
+        s = d->stack[--top];
+        if(s < 0 || d->mark[s] == d->gen) continue;
+        d->mark[s] = d->gen;
+        const struct rxState *st = &d->prog->states[s];
+        if(st->type == RXS_SPLIT){
+            d->stack[top++] = st->out1;
+            d->stack[top++] = st->out;
+        }else{
+            d->buf[(*n)++] = s;
+        }
+    }
+}
+
+// Returns the DFA state for a set of NFA states, adding it if it is new.
+int rxIntern(struct rxDFA *d, int *set, int n){
+    for(int i = 1; i < n; i++){
+        int v = set[i], j = i;
+        while(j > 0 && set[j - 1] > v){
+            set[j] = set[j - 1];
+            j--;
+        }
+        set[j] = v;
+    }
+
+    unsigned int h = 2166136261u;
+    for(int i = 0; i < n; i++) h = (h ^ set[i]) * 16777619u;
+    unsigned int mask = RX_MAX_DFA_STATES * 2 - 1;
+    for(h &= mask; d->hash[h]; h = (h + 1) & mask){
+        int id = d->hash[h] - 1;
+        if(d->setlen[id] == n && !memcmp(&d->pool[d->setstart[id]], set, sizeof(int) * n)) return id;
+    }
+
+    if(d->nstates == RX_MAX_DFA_STATES){
+        d->nstates = 0;
+        d->poolsize = 0;
+        d->start = -1;
+        d->flushes++;
+        memset(d->hash, 0, sizeof(int) * RX_MAX_DFA_STATES * 2);
+        h = 2166136261u;
+        for(int i = 0; i < n; i++) h = (h ^ set[i]) * 16777619u;
+        h &= mask;
+    }
+
+    int id = d->nstates;
+    if(id == d->statecap){
+        d->statecap = d->statecap ? d->statecap * 2 : 16;
+        d->trans = realloc(d->trans, sizeof(int) * 256 * d->statecap);
+        d->accept = realloc(d->accept, d->statecap);
+        d->setstart = realloc(d->setstart, sizeof(int) * d->statecap);
+        d->setlen = realloc(d->setlen, sizeof(int) * d->statecap);
+        if(!d->trans || !d->accept || !d->setstart || !d->setlen) die("realloc");
+    }
+    d->pool = rxGrow(d->pool, &d->poolcap, d->poolsize + n, sizeof(int));
+
+    memset(&d->trans[id * 256], 0xff, sizeof(int) * 256);
+    memcpy(&d->pool[d->poolsize], set, sizeof(int) * n);
+    d->setstart[id] = d->poolsize;
+    d->setlen[id] = n;
+    d->poolsize += n;
+    d->accept[id] = 0;
+    for(int i = 0; i < n; i++){
+        if(d->prog->states[set[i]].type == RXS_MATCH) d->accept[id] = 1;
+    }
+    d->hash[h] = id + 1;
+    d->nstates++;
+    return id;
+}
+
+int rxStart(struct rxDFA *d){
+    if(d->start < 0){
+        int n = 0;
+        d->gen++;
+        rxClosure(d, d->prog->start, &n);
+        d->start = rxIntern(d, d->buf, n);
+    }
+    return d->start;
+}
+
+int rxStep(struct rxDFA *d, int state, unsigned char c){
+    int next = d->trans[state * 256 + c];
+    if(next >= 0) return next >> 1;
+
+    int n = 0;
+    d->gen++;
+    const int *set = &d->pool[d->setstart[state]];
+    for(int i = 0; i < d->setlen[state]; i++){
+        const struct rxState *st = &d->prog->states[set[i]];
+        if(st->type == RXS_SET && rxSetHas(d->re->sets[st->set], c)) rxClosure(d, st->out, &n);
+    }
+    if(d->unanchored) rxClosure(d, d->prog->start, &n);
+
+    int flushes = d->flushes;
+    next = rxIntern(d, d->buf, n);
+    if(flushes == d->flushes) d->trans[state * 256 + c] = next << 1 | d->accept[next];
+    return next;
+}
+
+struct regexMatcher *regexMatcherNew(const struct regex *re){
+    struct regexMatcher *m = calloc(1, sizeof(struct regexMatcher));
+    if(m == NULL) die("calloc");
+    m->re = re;
+    rxDFAInit(&m->filter, re, &re->fwd, 1);
+    rxDFAInit(&m->starts, re, &re->rev, !re->eol);
+    rxDFAInit(&m->longest, re, &re->fwd, 0);
+
+    struct rxDFA *d = &m->filter;
+    int start = rxStart(d);
+    for(int c = 0; c < 256 && m->nfirst >= 0; c++){
+        for(int i = 0; i < d->setlen[start]; i++){
+            const struct rxState *st = &re->fwd.states[d->pool[d->setstart[start] + i]];
+            if(st->type != RXS_SET || !rxSetHas(re->sets[st->set], c)) continue;
+            if(m->nfirst == 3) m->nfirst = -1;
+            else m->first[m->nfirst++] = c;
+            break;
+        }
+    }
+    if(m->nfirst < 0) m->nfirst = 0;
+    return m;
+}
+
+void regexMatcherFree(struct regexMatcher *m){
+    if(m == NULL) return;
+    rxDFAFree(&m->filter);
+    rxDFAFree(&m->starts);
+    rxDFAFree(&m->longest);
+    free(m->marks);
+    free(m->memo);
+    free(m);
+}
+
+// Returns the first i' >= i with p[i'] one of bytes[0, nbytes), or n.
+size_t rxSkip(const unsigned char *p, size_t i, size_t n, const unsigned char *bytes, int nbytes){
+#if defined(__SSE2__)
+    const __m128i b0 = _mm_set1_epi8(bytes[0]);
+    const __m128i b1 = _mm_set1_epi8(bytes[nbytes > 1]);
+    const __m128i b2 = _mm_set1_epi8(bytes[nbytes - 1]);
+    for(; i + 16 <= n; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+            _mm_cmpeq_epi8(v, b0), _mm_cmpeq_epi8(v, b1)), _mm_cmpeq_epi8(v, b2)));
+        if(mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    for(; i < n; i++){
+        if(memchr(bytes, p[i], nbytes)) return i;
+    }
+    return n;
+}
+
+// Returns the offset in s[0, n) just past the earliest-ending match of the
+// pattern, ignoring ^ and $, or -1. A cheap way to skip text that holds no
+// match at all; regexMatchLine() gives the exact match.
+long regexFilter(struct regexMatcher *m, const char *s, size_t n){
+    struct rxDFA *d = &m->filter;
+    const unsigned char *p = (const unsigned char *)s;
+    int st = rxStart(d);
+    if(d->accept[st]) return 0;
+    for(size_t i = 0; i < n; i++){
+        // the unanchored start state loops on every byte no match starts
+        // with, so when those are few, jump to the next one that can
+        if(st == d->start && m->nfirst){
+            i = rxSkip(p, i, n, m->first, m->nfirst);
+            if(i == n) break;
+        }
+        int next = d->trans[st * 256 + p[i]];
+        if(next < 0){
+            st = rxStep(d, st, p[i]);
+            if(d->accept[st]) return i + 1;
+            continue;
+        }
+        if(next & 1) return i + 1;
+        st = next >> 1;
+    }
+    return -1;
+}
+
+// End of the longest match starting at s[i], or -1. The scan stops where
+// the DFA dies, or where it is in the state an earlier scan of the line
+// was in at the same column: from there on both read the same bytes the
+// same way, so the earlier scan's result holds. Scans from every column
+// of a line thus cost about one pass over it, not one pass each.
+int rxLongest(struct regexMatcher *m, const char *s, int i, int len){
+    struct rxDFA *d = &m->longest;
+    int eol = m->re->eol;
+    int st = rxStart(d);
+    int best = (d->accept[st] && (!eol || i == len)) ? i : -1;
+    // a flush renumbers the DFA states, so what memo holds is lost
+    if(m->memo_flushes != d->flushes){
+        m->memogen++;
+        m->memo_flushes = d->flushes;
+    }
+    m->memo = rxGrow(m->memo, &m->memocap, len, sizeof(struct rxMemo));
+
+    int j, end = -1;
+    for(j = i; j < len; j++){
+        st = rxStep(d, st, s[j]);
+        if(d->setlen[st] == 0) break;
+        if(d->accept[st] && (!eol || j + 1 == len)) best = j + 1;
+        // after a flush mid-scan the rest of it goes without memo
+        if(m->memo_flushes != d->flushes) continue;
+        struct rxMemo *mm = &m->memo[j];
+        if(mm->gen == m->memogen && mm->state == st){
+            end = mm->end;
+            if(end != -1) best = end;
+            break;
+        }
+        mm->gen = m->memogen;
+        mm->state = st;
+    }
+    if(m->memo_flushes != d->flushes){
+        m->memogen++;
+        m->memo_flushes = d->flushes;
+        return best;
+    }
+
+    // the ends of the columns just scanned, back to front
+    for(int k = j - 1; k >= i; k--){
+        if(end == -1 && d->accept[m->memo[k].state] && (!eol || k + 1 == len)) end = k + 1;
+        m->memo[k].end = end;
+    }
+    return best;
+}
+
+// Finds the leftmost-longest non-empty match in the line s[0, len) that
+// starts at or after `from`, storing its length in *mlen. One backward
+// pass marks every column a match can start at, then the first such column
+// that yields a non-empty match wins. The marks of the last line are kept:
+// a call resuming past a match on the same, unchanged line reuses them.
+int regexMatchLine(struct regexMatcher *m, const char *s, int len, int from, int *mlen){
+    if(from > len) return -1;
+    if(m->re->bol){
+        if(from > 0) return -1;
+        m->memogen++;
+        int end = rxLongest(m, s, 0, len);
+        if(end <= 0) return -1;
+        *mlen = end;
+        return 0;
+    }
+
+    // the starts pass covers the whole line once, so that the calls that
+    // resume past each match of the line only walk the marks
+    if(from == 0 || m->marks_s != s || m->marks_len != len){
+        m->marks = rxGrow(m->marks, &m->markcap, len + 1, 1);
+        memset(m->marks, 0, len + 1);
+        struct rxDFA *d = &m->starts;
+        int st = rxStart(d);
+        for(int i = len - 1; i >= 0; i--){
+            st = rxStep(d, st, s[i]);
+            if(d->setlen[st] == 0) break;
+            if(d->accept[st]) m->marks[i] = 1;
+        }
+        m->marks_s = s;
+        m->marks_len = len;
+        m->memogen++;
+    }
+
+    for(int i = from; i < len; i++){
+        if(!m->marks[i]) continue;
+        int end = rxLongest(m, s, i, len);
+        if(end > i){
+            *mlen = end - i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*** search ***/
+
+// How rare byte c is by SEARCH_COMMON, higher for rarer.
+int editorSearchRank(char c){
+    const char *p = c ? strchr(SEARCH_COMMON, c) : NULL;
+    return p ? p - SEARCH_COMMON : (int)sizeof(SEARCH_COMMON);
+}
+
+void editorSearchCompile(struct editorSearch *s, const char *needle){
+    s->needle = needle;
+    s->len = strlen(needle);
+    for(int c = 0; c < 256; c++) s->skip[c] = s->len;
+    for(size_t j = 0; j + 1 < s->len; j++) s->skip[(unsigned char)needle[j]] = s->len - 1 - j;
+    s->rare[0] = s->rare[1] = 0;
+    for(size_t j = 1; j < s->len; j++){
+        if(editorSearchRank(needle[j]) > editorSearchRank(needle[s->rare[0]])) s->rare[0] = j;
+    }
+    s->rare[1] = s->rare[0] ? 0 : 1;
+    for(size_t j = 0; j < s->len; j++){
+        if(j == s->rare[0]) continue;
+        // a second copy of the rarest byte filters out nothing more
+        int distinct = needle[j] != needle[s->rare[0]];
+        int best = needle[s->rare[1]] != needle[s->rare[0]];
+        if(distinct > best || (distinct == best &&
+            editorSearchRank(needle[j]) > editorSearchRank(needle[s->rare[1]]))) s->rare[1] = j;
+    }
+    s->re = NULL;
+    s->matcher = NULL;
+}
+
+// The literal fields hold the bytes every match of re contains, if there
+// are enough of them to be worth skipping ahead to, see editorSearchFilter().
+void editorSearchCompileRegex(struct editorSearch *s, struct regex *re){
+    editorSearchCompile(s, re->litlen >= 2 ? re->literal : "");
+    s->re = re;
+    s->matcher = regexMatcherNew(re);
+}
+
+void editorSearchFree(struct editorSearch *s){
+    regexMatcherFree(s->matcher);
+    s->matcher = NULL;
+}
+
+const char *editorSearchHorspool(const struct editorSearch *s, const char *hay, size_t n){
+    size_t len = s->len;
+    unsigned char last = s->needle[len - 1];
+    size_t i = 0;
+    while(i + len <= n){
+        unsigned char c = hay[i + len - 1];
+        if(c == last && !memcmp(hay + i, s->needle, len - 1)) return hay + i;
+        i += s->skip[c];
+    }
+    return NULL;
+}
+
+#if defined(__SSE2__)
+// Filters hay[0, n) a block of offsets at a time with compares of the
+// needle's two rarest bytes, so only offsets where both agree reach
+// memcmp. Returns the match, or NULL with *at past the last whole block.
+const char *editorSearchBlocks(const struct editorSearch *s, const char *hay, size_t n, size_t *at){
+    size_t len = s->len, i = 0;
+    size_t r0 = s->rare[0], r1 = s->rare[1];
+    const __m128i b0 = _mm_set1_epi8(s->needle[r0]);
+    const __m128i b1 = _mm_set1_epi8(s->needle[r1]);
+    for(; i + len - 1 + 16 <= n; i += 16){
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(hay + i + r0));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(hay + i + r1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(v0, b0), _mm_cmpeq_epi8(v1, b1)));
+        while(mask){
+            int bit = __builtin_ctz(mask);
+            if(!memcmp(hay + i + bit, s->needle, len)) return hay + i + bit;
+            mask &= mask - 1;
+        }
     }
-    updateOperation(INSERT);
+    *at = i;
+    return NULL;
 }
 
-void editorInsertNewline(){
-    if(E.cx == 0){
-        editorInsertRow(E.cy, "", 0);
-    }else{
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+TARGET_AVX2
+const char *editorSearchBlocksAVX2(const struct editorSearch *s, const char *hay, size_t n, size_t *at){
+    size_t len = s->len, i = 0;
+    size_t r0 = s->rare[0], r1 = s->rare[1];
+    const __m256i b0 = _mm256_set1_epi8(s->needle[r0]);
+    const __m256i b1 = _mm256_set1_epi8(s->needle[r1]);
+    for(; i + len - 1 + 32 <= n; i += 32){
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(hay + i + r0));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(hay + i + r1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(v0, b0), _mm256_cmpeq_epi8(v1, b1)));
+        while(mask){
+            int bit = __builtin_ctz(mask);
+            if(!memcmp(hay + i + bit, s->needle, len)) return hay + i + bit;
+            mask &= mask - 1;
+        }
     }
-    E.cy++;
-    E.cx = 0;
+    *at = i;
+    return NULL;
+}
+#endif
+
+// Returns the first occurrence of the needle in hay[0, n), or NULL. Whole
+// blocks go through the SIMD filter; the tail that does not fill a block
+// goes through Horspool.
+const char *editorSearchMem(const struct editorSearch *s, const char *hay, size_t n){
+    size_t len = s->len;
+    if(len == 0) return hay;
+    if(n < len) return NULL;
+    if(len == 1) return memchr(hay, s->needle[0], n);
+
+    size_t i = 0;
+#if defined(__SSE2__)
+    const char *match = CPU_HAS_AVX2() ? editorSearchBlocksAVX2(s, hay, n, &i) :
+        editorSearchBlocks(s, hay, n, &i);
+    if(match) return match;
+#endif
+    return editorSearchHorspool(s, hay + i, n - i);
 }
 
-/*** file i/o ***/
-char *editorRowsToString(int *buflen){
-    int total_len = 0;
-    int j;
-    for(j = 0; j < E.numrows; j++){
-        total_len += E.row[j].size + 1;
-    }
-    *buflen = total_len;
-
-    char *buf = malloc(total_len);
-    char *p = buf;
-    for(j = 0; j < E.numrows; j++){
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+int editorRowInMap(erow *row){
+    return E.map && row->chars >= E.map && row->chars < E.map + E.mapsize;
+}
+
+// Returns the row of the chunk [filerow, last] whose text holds `at`. Rows
+// of a chunk ascend in memory, so this is a bisection.
+int editorSearchChunkRow(int filerow, int last, const char *at){
+    while(filerow < last){
+        int mid = filerow + (last - filerow + 1) / 2;
+        if(editorRowAt(mid)->chars <= at) filerow = mid;
+        else last = mid - 1;
     }
-    return buf;
+    return filerow;
 }
 
-void closeEditor(){
-    for(int i = 0; i < E.numrows; i++){
-        editorFreeRow(&E.row[i]);
+// Extends a chunk starting at `filerow` over the following rows of [filerow,
+// to) that sit right after it in the file mapping, so they can be scanned
+// in one go. Rows above E.map_rows are known to, so the chunk's end among
+// them is bisected, about SEARCH_CHUNK_BYTES on; other rows are checked
+// one by one, up to SEARCH_CHUNK_ROWS at a time. Returns the
+// chunk's last row and stores its end in *end. Only chars and size are
+// read: find workers call this while the UI thread keeps updating the
+// other fields. The prompt never lets a control character into a needle,
+// so no match can straddle the line break between two rows.
+int editorSearchChunk(int filerow, int to, const char **end){
+    erow *row = editorRowAt(filerow);
+    *end = row->chars + row->size;
+    int last = filerow;
+    if(filerow < E.map_rows){
+        int limit = (to < E.map_rows ? to : E.map_rows) - 1;
+        size_t room = E.map + E.mapsize - row->chars;
+        last = editorSearchChunkRow(filerow, limit,
+            row->chars + (room < SEARCH_CHUNK_BYTES ? room : SEARCH_CHUNK_BYTES));
+        row = editorRowAt(last);
+        *end = row->chars + row->size;
+        return last;
     }
-    if(E.row) free(E.row);
-    if(E.filename){
-        free(E.filename);
-        E.filename = NULL;
+    if(!editorRowInMap(row)) return last;
+
+    while(last + 1 < to && last - filerow < SEARCH_CHUNK_ROWS){
+        erow *next = editorRowAt(last + 1);
+        if(!editorRowInMap(next) || next->chars <= *end || next->chars - *end > 2) break;
+        *end = next->chars + next->size;
+        last++;
     }
-    E.numrows = 0;
-    E.row = NULL;
-    E.dirty = 0;
-    E.checkpoint[0] = 0;
-    E.checkpoint[1] = 0;
-    E.last_operation = NO_OP;
-    E.syntax = NULL;
-    editorSetStatusMessage("File closing...");
+    return last;
 }
 
-FILE *openFile(char *filename){
-    FILE *fp = fopen(filename, "a+");
-    if(!fp) die("fopen");
-    return fp;
+// Returns a byte of the first row in text[p, end) that may hold a regex
+// match, or NULL. Only a row it points into can have one.
+const char *editorSearchFilter(struct editorSearch *s, const char *p, const char *end){
+    if(s->len) return editorSearchMem(s, p, end - p);
+    long at = regexFilter(s->matcher, p, end - p);
+    if(at == -1) return NULL;
+    return p + (at > 0 ? at - 1 : 0);
 }
 
-void openEditor(char *filename){
-    free(E.filename);
+// Finds the first match in the row starting at or after column `from`,
+// storing its length in *mlen. Returns its column or -1.
+int editorSearchRow(struct editorSearch *s, erow *row, int from, int *mlen){
+    if(from > row->size) return -1;
+    if(s->re) return regexMatchLine(s->matcher, row->chars, row->size, from, mlen);
 
-    if(filename == NULL){
-        E.filename = NULL;
-        return;
+    const char *match = editorSearchMem(s, row->chars + from, row->size - from);
+    if(match == NULL) return -1;
+    *mlen = s->len;
+    return match - row->chars;
+}
+
+// Finds the first row in [from, to) containing a match and stores the
+// match column in *cx, or returns -1. A regex filters whole chunks and
+// only the rows the filter stops in get an exact match.
+int editorSearchForward(struct editorSearch *s, int from, int to, int *cx){
+    int filerow = from;
+    while(filerow < to){
+        const char *start = editorRowAt(filerow)->chars;
+        const char *end;
+        int last = editorSearchChunk(filerow, to, &end);
+
+        if(s->re){
+            const char *at;
+            while((at = editorSearchFilter(s, start, end)) != NULL){
+                filerow = editorSearchChunkRow(filerow, last, at);
+                int mlen;
+                *cx = editorSearchRow(s, editorRowAt(filerow), 0, &mlen);
+                if(*cx != -1) return filerow;
+                if(++filerow > last) break;
+                start = editorRowAt(filerow)->chars;
+            }
+            filerow = last + 1;
+            continue;
+        }
+
+        const char *match = editorSearchMem(s, start, end - start);
+        if(match){
+            filerow = editorSearchChunkRow(filerow, last, match);
+            *cx = match - editorRowAt(filerow)->chars;
+            return filerow;
+        }
+        filerow = last + 1;
     }
+    return -1;
+}
 
-    E.filename = strdup(filename);
+// Like editorSearchForward(), walking rows from `from` down to `to`.
+int editorSearchBackward(struct editorSearch *s, int from, int to, int *cx){
+    for(int filerow = from; filerow >= to; filerow--){
+        int mlen;
+        *cx = editorSearchRow(s, editorRowAt(filerow), 0, &mlen);
+        if(*cx != -1) return filerow;
+    }
+    return -1;
+}
 
-    editorSelectSyntaxHiglight();
+/*** find ***/
 
-    FILE *fp = openFile(filename);
-    if(!fp) die("fopen");
+void editorFindJobAdd(struct findJob *job, int filerow, int col){
+    if(job->nhits == job->hitcap){
+        job->hitcap = job->hitcap ? job->hitcap * 2 : 256;
+        job->hits = realloc(job->hits, sizeof(int) * 2 * job->hitcap);
+        if(job->hits == NULL) die("realloc");
+    }
+    job->hits[job->nhits * 2] = filerow;
+    job->hits[job->nhits * 2 + 1] = col;
+    job->nhits++;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    linelen = getline(&line, &linecap, fp);
-    if(linelen != -1){
-        while((linelen = getline(&line, &linecap, fp)) != -1){
-            while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')){
-                linelen--;
+// Counts `bytes` more of text scanned and, every FIND_CHECK_BYTES, lets
+// the UI count the hits so far. Returns 1 once the find is cancelled.
+int editorFindJobCheck(struct findJob *job, size_t bytes){
+    struct findIndex *fi = &E.find;
+    job->scanned += bytes;
+    if(job->scanned < FIND_CHECK_BYTES) return 0;
+    job->scanned = 0;
+    pthread_mutex_lock(&fi->lock);
+    job->published = job->nhits;
+    int cancel = fi->cancel;
+    pthread_mutex_unlock(&fi->lock);
+    return cancel;
+}
+
+void *editorFindWorker(void *arg){
+    struct findJob *job = arg;
+    struct findIndex *fi = &E.find;
+    struct editorSearch *search = &job->search;
+    int cancel = 0;
+    int filerow = job->from;
+
+    while(filerow < job->to && !cancel){
+        const char *end;
+        int last = editorSearchChunk(filerow, job->to, &end);
+        const char *p = editorRowAt(filerow)->chars;
+        // a row costs a byte even when empty
+        cancel = editorFindJobCheck(job, last - filerow + 1);
+
+        if(search->re){
+            // regex matches never overlap: each one resumes past the last
+            const char *at;
+            while(!cancel && (at = editorSearchFilter(search, p, end)) != NULL){
+                filerow = editorSearchChunkRow(filerow, last, at);
+                erow *row = editorRowAt(filerow);
+                int col = 0, mlen;
+                while((col = editorSearchRow(search, row, col, &mlen)) != -1){
+                    editorFindJobAdd(job, filerow, col);
+                    col += mlen;
+                }
+                cancel = editorFindJobCheck(job, row->chars + row->size - p);
+                if(++filerow > last) break;
+                p = editorRowAt(filerow)->chars;
+            }
+            if(!cancel && filerow <= last) cancel = editorFindJobCheck(job, end - p);
+        }else{
+            // scanned a window at a time, however long the rows, so that
+            // a cancel is seen soon; windows overlap by the needle's
+            // length less one, so a match across two is still found
+            while(!cancel && p < end){
+                const char *stop = end - p > FIND_CHECK_BYTES ? p + FIND_CHECK_BYTES : end;
+                const char *wend = end - stop > (long)search->len ? stop + search->len - 1 : end;
+                const char *match = editorSearchMem(search, p, wend - p);
+                if(match){
+                    while(filerow < last && editorRowAt(filerow + 1)->chars <= match) filerow++;
+                    editorFindJobAdd(job, filerow, match - editorRowAt(filerow)->chars);
+                    // overlapping matches are kept so that a longer query's
+                    // matches are always a subset, see editorFindIndexNarrow()
+                    cancel = editorFindJobCheck(job, match + 1 - p);
+                    p = match + 1;
+                }else{
+                    cancel = editorFindJobCheck(job, stop - p);
+                    p = stop;
+                }
             }
-            editorInsertRow(E.numrows, line, linelen);
         }
-    } 
-    free(line);
-    fclose(fp);
-    E.checkpoint[0] = E.cy;
-    E.checkpoint[1] = E.cx;
+        filerow = last + 1;
+    }
 
-    E.dirty = 0;
+    pthread_mutex_lock(&fi->lock);
+    job->published = job->nhits;
+    job->done = 1;
+    pthread_mutex_unlock(&fi->lock);
+    editorWake();
+    return NULL;
 }
 
-void openEditorCallback(char *filename, int key){
-    if(key == '\r'){
-        openEditor(filename);
-    } else if(key == '\x1b'){
-        editorSetStatusMessage("");
+void editorFindIndexStop(){
+    struct findIndex *fi = &E.find;
+    if(!fi->active) return;
+
+    pthread_mutex_lock(&fi->lock);
+    fi->cancel = 1;
+    pthread_mutex_unlock(&fi->lock);
+    for(int j = 0; j < fi->njobs; j++){
+        if(fi->jobs[j].joinable) pthread_join(fi->jobs[j].thread, NULL);
+        free(fi->jobs[j].hits);
+        editorSearchFree(&fi->jobs[j].search);
     }
+    pthread_mutex_destroy(&fi->lock);
+    free(fi->hits);
+    free(fi->query);
+    editorSearchFree(&fi->search);
+    regexFree(fi->search.re);
+    memset(fi, 0, sizeof(*fi));
 }
 
-void editorSave(){
-    updateOperation(SAVE);
-    if(E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if(E.filename == NULL){
-            editorSetStatusMessage("Save aborted");
+// When the new query extends a query whose index is complete, every match
+// of it starts at a match of the old one, so filtering the old hits gives
+// the new index without looking at the rest of the file.
+int editorFindIndexNarrow(const char *query){
+    struct findIndex *fi = &E.find;
+    if(!fi->active || !fi->merged || fi->regex) return 0;
+
+    size_t oldlen = strlen(fi->query);
+    size_t len = strlen(query);
+    if(len <= oldlen || strncmp(query, fi->query, oldlen)) return 0;
+
+    char *newquery = strdup(query);
+    if(newquery == NULL) return 0;
+    free(fi->query);
+    fi->query = newquery;
+    editorSearchCompile(&fi->search, fi->query);
+
+    int kept = 0;
+    for(int k = 0; k < fi->nhits; k++){
+        int r = fi->hits[k * 2], c = fi->hits[k * 2 + 1];
+        erow *row = editorRowAt(r);
+        if(c + len <= (size_t)row->size && !memcmp(&row->chars[c], query, len)){
+            fi->hits[kept * 2] = r;
+            fi->hits[kept * 2 + 1] = c;
+            kept++;
+        }
+    }
+    fi->nhits = kept;
+    fi->row = fi->col = -1;
+    return 1;
+}
+
+// Splits the rows between up to one worker per core, each collecting the
+// matches in its slice. The UI thread is free to keep drawing meanwhile;
+// nothing may edit rows until editorFindIndexStop(). A regex that does not
+// parse gives a complete index with no hits.
+void editorFindIndexStart(const char *query, int regex){
+    struct findIndex *fi = &E.find;
+    if(!regex && editorFindIndexNarrow(query)) return;
+    editorFindIndexStop();
+    if(query[0] == '\0' || E.numrows == 0) return;
+
+    fi->active = 1;
+    fi->query = strdup(query);
+    fi->regex = regex;
+    fi->row = fi->col = -1;
+    editorSearchCompile(&fi->search, fi->query);
+    pthread_mutex_init(&fi->lock, NULL);
+    if(regex){
+        struct regex *re = regexCompile(query);
+        if(re == NULL){
+            fi->bad = strlen(query) > RX_MAX_PATTERN ? 2 : 1;
+            fi->merged = 1;
             return;
         }
-        editorSelectSyntaxHiglight();
+        editorSearchCompileRegex(&fi->search, re);
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int njobs = E.numrows / FIND_ROWS_PER_JOB + 1;
+    if(ncpu > 0 && njobs > ncpu) njobs = ncpu;
+    if(njobs > FIND_MAX_JOBS) njobs = FIND_MAX_JOBS;
+    fi->njobs = njobs;
+
+    for(int j = 0; j < njobs; j++){
+        struct findJob *job = &fi->jobs[j];
+        job->from = (long)E.numrows * j / njobs;
+        job->to = (long)E.numrows * (j + 1) / njobs;
+        job->search = fi->search;
+        if(regex) job->search.matcher = regexMatcherNew(fi->search.re);
+    }
+    for(int j = 0; j < njobs; j++){
+        struct findJob *job = &fi->jobs[j];
+        job->joinable = pthread_create(&job->thread, NULL, editorFindWorker, job) == 0;
+        // no thread to spare: scan the slice right here
+        if(!job->joinable) editorFindWorker(job);
+    }
+}
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if(fd != -1){
-        if(ftruncate(fd, len) != -1){
-            if(write(fd, buf, len) == len){
-                close(fd);
-                free(buf);
-                E.checkpoint[0] = E.cy;
-                E.checkpoint[1] = E.cx;
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
-        close(fd);
+// Returns 1 once every worker is done, merging their hits on first call.
+int editorFindIndexReady(){
+    struct findIndex *fi = &E.find;
+    if(!fi->active) return 0;
+    if(fi->merged) return 1;
+
+    int done = 1;
+    pthread_mutex_lock(&fi->lock);
+    for(int j = 0; j < fi->njobs; j++) done &= fi->jobs[j].done;
+    pthread_mutex_unlock(&fi->lock);
+    if(!done) return 0;
+
+    int total = 0;
+    for(int j = 0; j < fi->njobs; j++){
+        struct findJob *job = &fi->jobs[j];
+        if(job->joinable) pthread_join(job->thread, NULL);
+        job->joinable = 0;
+        total += job->nhits;
+    }
+    fi->hits = malloc(sizeof(int) * 2 * (total ? total : 1));
+    if(fi->hits == NULL) die("malloc");
+    for(int j = 0; j < fi->njobs; j++){
+        struct findJob *job = &fi->jobs[j];
+        memcpy(&fi->hits[fi->nhits * 2], job->hits, sizeof(int) * 2 * job->nhits);
+        fi->nhits += job->nhits;
+        free(job->hits);
+        job->hits = NULL;
     }
+    fi->merged = 1;
+    return 1;
 }
 
-/*** find ***/
+// Number of merged hits that come before (row, col).
+int editorFindIndexRank(int row, int col){
+    struct findIndex *fi = &E.find;
+    int lo = 0, hi = fi->nhits;
+    while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        int r = fi->hits[mid * 2], c = fi->hits[mid * 2 + 1];
+        if(r < row || (r == row && c < col)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Picks the match after (or before) the current one from the merged index,
+// wrapping around the ends. Returns its row and stores its column in *cx.
+int editorFindIndexStep(int direction, int *cx){
+    struct findIndex *fi = &E.find;
+    if(fi->nhits == 0) return -1;
+
+    int k;
+    if(fi->row == -1){
+        k = 0;
+    }else if(direction == 1){
+        k = editorFindIndexRank(fi->row, fi->col + 1);
+        if(k == fi->nhits) k = 0;
+    }else{
+        k = editorFindIndexRank(fi->row, fi->col) - 1;
+        if(k < 0) k = fi->nhits - 1;
+    }
+    *cx = fi->hits[k * 2 + 1];
+    return fi->hits[k * 2];
+}
+
+void editorFindIndexStatus(char *buf, size_t size){
+    struct findIndex *fi = &E.find;
+    buf[0] = '\0';
+    if(!fi->active) return;
+
+    const char *mode = fi->regex ? " | regex" : "";
+    if(fi->bad){
+        snprintf(buf, size, fi->bad == 2 ? " | regex too long" : " | bad regex");
+    }else if(editorFindIndexReady()){
+        if(fi->nhits == 0) snprintf(buf, size, "%s | no matches", mode);
+        else if(fi->row != -1) snprintf(buf, size, "%s | match %d of %d", mode,
+            editorFindIndexRank(fi->row, fi->col) + 1, fi->nhits);
+        else snprintf(buf, size, "%s", mode);
+        return;
+    }else{
+        int found = 0;
+        pthread_mutex_lock(&fi->lock);
+        for(int j = 0; j < fi->njobs; j++) found += fi->jobs[j].published;
+        pthread_mutex_unlock(&fi->lock);
+        snprintf(buf, size, "%s | %d+ matches, scanning", mode, found);
+    }
+}
+
+int editorBackgroundBusy(){
+    return (E.find.active && !E.find.merged) || E.save.active;
+}
 
 void editorFindCallback(char *query, int key){
     static int last_match = -1; // -1 if no match found else row number
     static int direction = 1; // 1 for forward, -1 for backward
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+    static int regex = 0; // toggled with Ctrl-R
+
+    // the index only reports progress, which the status bar picks up
+    if(key == IDLE_KEY) return;
 
-    if(saved_hl){
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+    if(key == CTRL_KEY('r')) regex = !regex;
+    // any other key that leaves the query as it was keeps the index and
+    // the match shown
+    int moves = key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP;
+    if(!moves && key != '\r' && key != '\x1b' && E.find.active &&
+        E.find.regex == regex && !strcmp(E.find.query, query)) return;
+
+    if(E.match_row != -1){
+        editorDamageRows(E.match_row, E.match_row + 1);
+        E.match_row = -1;
     }
 
     if(key == '\r' || key == '\x1b'){
         last_match = -1;
         direction = 1;
+        regex = 0;
         return;
     }else if(key == ARROW_RIGHT || key == ARROW_DOWN){
         direction = 1;
@@ -735,31 +3983,50 @@ void editorFindCallback(char *query, int key){
     }else{
         last_match = -1;
         direction = 1;
+        editorFindIndexStart(query, regex);
     }
 
     if(last_match == -1) direction = 1;
-    int current = last_match;
+    if(E.find.bad) return;
 
-    int i;
-    for(i = 0; i < E.numrows; i++){
-        current += direction;
-        if(current == -1) current = E.numrows - 1;
-        else if(current == E.numrows) current = 0;
+    struct editorSearch search;
+    if(E.find.active && E.find.regex) editorSearchCompileRegex(&search, E.find.search.re);
+    else editorSearchCompile(&search, query);
 
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if(match){
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxtoCx(row, match - row->render);
-            E.rowoffset = E.numrows;
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+    // once the index is complete a step is a binary search in it; until
+    // then scan chars from the last match, the wrap-around visiting
+    // last_match itself last
+    int cx;
+    int current;
+    if(editorFindIndexReady()){
+        current = editorFindIndexStep(direction, &cx);
+    }else if(direction == 1){
+        current = editorSearchForward(&search, last_match + 1, E.numrows, &cx);
+        if(current == -1) current = editorSearchForward(&search, 0, last_match + 1, &cx);
+    }else{
+        current = editorSearchBackward(&search, last_match - 1, 0, &cx);
+        if(current == -1) current = editorSearchBackward(&search, E.numrows - 1, last_match, &cx);
     }
+
+    if(current != -1){
+        editorHighlightRows(current, current + 1);
+        erow *row = editorRowAt(current);
+        int mlen;
+        cx = editorSearchRow(&search, row, cx, &mlen);
+        int rx = editorRowCxToRx(row, cx);
+        last_match = current;
+        E.cy = current;
+        E.cx = cx;
+        E.rowoffset = E.numrows;
+        E.find.row = current;
+        E.find.col = cx;
+        // drawn over the row's own highlighting, which stays as it is
+        E.match_row = current;
+        E.match_from = rx;
+        E.match_to = editorRowCxToRx(row, cx + mlen);
+        editorDamageRows(current, current + 1);
+    }
+    editorSearchFree(&search);
 }
 
 void editorFind(){
@@ -768,7 +4035,10 @@ void editorFind(){
     int saved_coloffset = E.coloffset;
     int saved_rowoffset = E.rowoffset;
     
-    char *query = editorPrompt(" Search: %s (ESC to cancel/ Arrows to Move/ Enter to Confirm)", editorFindCallback);
+    char *query = editorPrompt(" Search: %s (ESC to cancel/ Arrows to Move/ Ctrl-R regex/ Enter to Confirm)", editorFindCallback);
+    // Enter on a non-empty query skips the callback, which resets its state
+    editorFindCallback("", '\r');
+    editorFindIndexStop();
 
     if(query){
         free(query);
@@ -781,11 +4051,31 @@ void editorFind(){
 }
 
 void initEditor(){
+    E.main_thread = pthread_self();
     E.cx = 0;
     E.cy = 0;
     E.rx = 0;
     E.numrows = 0;
     E.row = NULL;
+    E.rowcap = 0;
+    E.gapstart = 0;
+    E.owned = NULL;
+    E.nowned = 0;
+    E.ownedcap = 0;
+    E.map = NULL;
+    E.mapsize = 0;
+    E.map_rows = 0;
+    E.hl_frontier = 0;
+    E.match_row = -1;
+    memset(&E.save, 0, sizeof(E.save));
+    pthread_mutex_init(&E.save.lock, NULL);
+    memset(&E.journal, 0, sizeof(E.journal));
+    E.journal.pending = (struct abuf)ABUF_INIT;
+    memset(&E.undo, 0, sizeof(E.undo));
+    E.undo.limit = UNDO_MEMORY_LIMIT;
+    E.frame = (struct abuf)ABUF_INIT;
+    memset(&E.screen, 0, sizeof(E.screen));
+    E.screen.damage_to = INT_MAX;
     E.rowoffset = 0;
     E.coloffset = 0;
     E.dirty = 0;
@@ -797,13 +4087,14 @@ void initEditor(){
     E.checkpoint[1] = 0;
     E.syntax = NULL;
 
-    if(getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-    E.screenrows -= 3;
+    editorUpdateWindowSize();
+    editorInitInput();
 }
 
 
 // disable raw mode
 void disableRawMode(){
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -824,10 +4115,14 @@ void enableRawMode(){
 
     raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN); // ECHO -> echo off, ICANON -> canonical mode off, ISIG -> ctrl-c, ctrl-z off, IEXTEN -> ctrl-v off
 
-    raw.c_cc[VMIN] = 0; // min number of bytes needed before read() can return
-    raw.c_cc[VTIME] = 1; // max time to wait before read() returns
+    // reads never block: editorReadKey() waits in poll() instead
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr"); // set the new attributes of the terminal
+
+    // have pastes bracketed by ESC[200~ and ESC[201~, see PASTE_KEY
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int)){
@@ -839,7 +4134,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
 
     while(1){
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        if(!editorInputPending()) editorRefreshScreen();
 
         int c = editorReadKey();
         if(c == '\r'){
@@ -854,6 +4149,19 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
             }
             buf[buflen++] = c;
             buf[buflen] = '\0';
+        }else if(c == PASTE_KEY){
+            // a prompt holds one line: keep the printable text
+            struct abuf *paste = &E.input.paste;
+            for(int j = 0; j < paste->len; j++){
+                unsigned char ch = paste->b[j];
+                if(iscntrl(ch) || ch >= 128) continue;
+                if(buflen == bufsize - 1){
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = ch;
+            }
+            buf[buflen] = '\0';
         }else if(c == '\x1b'){
             editorSetStatusMessage("");
             free(buf);
@@ -867,7 +4175,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
 }
 
 void moveCursor(int key){
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
     switch(key){
         case ARROW_UP:
            if(E.cy > 0) E.cy--;
@@ -880,7 +4188,7 @@ void moveCursor(int key){
                 E.cx--;
             } else if(E.cy > 0){
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -907,7 +4215,7 @@ void moveCursor(int key){
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
     if(E.cx > rowlen){
         E.cx = rowlen;
@@ -925,6 +4233,7 @@ void editorProcessKeyPress(){
             break;
 
         case CTRL_KEY('x'):
+            editorSaveFinish(1);
             if(E.dirty && quit_times > 0){
                 editorSetStatusMessage("WARING!!! File has unsaved changes. "
                 "Press Ctrl-X %d more times to quit.", quit_times);
@@ -941,6 +4250,18 @@ void editorProcessKeyPress(){
             editorSave();
             break;
 
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
+        case PASTE_KEY:
+            editorInsertText(E.input.paste.b, E.input.paste.len);
+            break;
+
         case CTRL_KEY('o'):
             {
                 char *filename = editorPrompt("Open file: %s (ESC to cancel)", NULL);
@@ -953,7 +4274,7 @@ void editorProcessKeyPress(){
             break;
 
         case CTRL_KEY('g'):
-            editorSetStatusMessage("HELP : Ctrl-S = save | Ctrl-X = quit | Ctrl-F = find | Ctrl-G = help");
+            editorSetStatusMessage("HELP : Ctrl-S = save | Ctrl-X = quit | Ctrl-F = find | Ctrl-Z = undo | Ctrl-Y = redo | Ctrl-G = help");
             break;
 
         case CTRL_KEY('f'):
@@ -965,7 +4286,7 @@ void editorProcessKeyPress(){
             break;
 
         case END_KEY:
-            if(E.cy < E.numrows) E.cx = E.row[E.cy].size;
+            if(E.cy < E.numrows) E.cx = editorRowAt(E.cy)->size;
             break;
 
         case PAGE_UP:
@@ -1003,6 +4324,10 @@ void editorProcessKeyPress(){
         case '\x1b':
             break;
 
+        // a timer tick is not a keypress, so the quit countdown goes on
+        case IDLE_KEY:
+            return;
+
         default:
             editorInsertChar(c);
             break;
@@ -1010,22 +4335,40 @@ void editorProcessKeyPress(){
     quit_times = EDITOR_QUIT_TIMES;
 }
 
-void splashScreen(struct abuf *ab){
+// Puts s[0, n) at the end of the line being composed, clipped to the width.
+void screenPut(const char *s, int n, unsigned char attr){
+    struct editorScreen *sc = &E.screen;
+    if(n > sc->cols - sc->linelen) n = sc->cols - sc->linelen;
+    if(n <= 0) return;
+    memcpy(&sc->line[sc->linelen], s, n);
+    memset(&sc->line_attrs[sc->linelen], attr, n);
+    sc->linelen += n;
+}
+
+void screenRepeat(char c, int n, unsigned char attr){
+    struct editorScreen *sc = &E.screen;
+    if(n > sc->cols - sc->linelen) n = sc->cols - sc->linelen;
+    if(n <= 0) return;
+    memset(&sc->line[sc->linelen], c, n);
+    memset(&sc->line_attrs[sc->linelen], attr, n);
+    sc->linelen += n;
+}
+
+void splashScreen(){
     char welcome[80];
     int welcomelen = snprintf(welcome, sizeof(welcome),
     "BXEDTOR version --- %s", EDITOR_VERSION);
     if(welcomelen > E.screencols) welcomelen = E.screencols;
     int padding = (E.screencols - welcomelen) / 2;
     if(padding){
-        abAppend(ab, "~", 1);
+        screenPut("~", 1, 0);
         padding--;
     }
-    while(padding--) abAppend(ab, " ", 1);
-    abAppend(ab, welcome, welcomelen);
+    screenRepeat(' ', padding, 0);
+    screenPut(welcome, welcomelen, 0);
 }
 // Top Bar will display Version of application and Filename
-void editorDrawTopBar(struct abuf *ab){
-    abAppend(ab, "\x1b[7m]",4);
+void editorDrawTopBar(){
     char version[80], filename[21];
     int versionlen = snprintf(version, sizeof(version), "BXEDTOR version --- %s", EDITOR_VERSION);
     int filenamelen = snprintf(filename, sizeof(filename), "%s%.20s", E.dirty?"*":"" ,E.filename ? E.filename : "Untitled");
@@ -1035,48 +4378,36 @@ void editorDrawTopBar(struct abuf *ab){
     int padding = (E.screencols - filenamelen) / 2;
     if (padding < 0) padding = 0;
 
-    abAppend(ab, version, versionlen);
-    while(versionlen < padding){
-        abAppend(ab, " ", 1);
-        versionlen++;
-    }
-    abAppend(ab, filename, filenamelen);
-    while(versionlen + filenamelen < E.screencols){
-        abAppend(ab, " ", 1);
-        versionlen++;
-    }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    screenPut(version, versionlen, SCREEN_INVERSE);
+    screenRepeat(' ', padding - versionlen, SCREEN_INVERSE);
+    screenPut(filename, filenamelen, SCREEN_INVERSE);
+    screenRepeat(' ', E.screencols, SCREEN_INVERSE);
 }
 
-void editorDrawStatusBar(struct abuf *ab){
-    abAppend(ab, "\x1b[7m", 4);
-    char editor_status[80], rstatus[80];
-    int len = snprintf(editor_status, sizeof(editor_status), " %s - %d lines",
-    E.last_operation == INSERT ? "(INSERT)" : E.last_operation == DELETE ? "(DELETE)" : E.last_operation == SAVE ? "(SAVE)" : ""
-    , E.numrows);
+void editorDrawStatusBar(){
+    char editor_status[80], rstatus[80], find_status[40], save_status[20];
+    editorFindIndexStatus(find_status, sizeof(find_status));
+    editorSaveStatus(save_status, sizeof(save_status));
+    int len = snprintf(editor_status, sizeof(editor_status), " %s - %d lines%s%s",
+    E.last_operation == INSERT ? "(INSERT)" : E.last_operation == DELETE ? "(DELETE)" : E.last_operation == SAVE ? "(SAVE)" :
+    E.last_operation == UNDO ? "(UNDO)" : E.last_operation == REDO ? "(REDO)" : ""
+    , E.numrows, find_status, save_status);
     int rlen = snprintf(rstatus, sizeof(rstatus), "%s Row : %d Col : %d", 
     E.syntax ? E.syntax->filetype : "no ft",E.cy + 1, E.cx + 1);
-    abAppend(ab, editor_status, len);
-    while(len < E.screencols){
-        if(E.screencols - len == rlen){
-            abAppend(ab, rstatus, rlen);
-            break;
-        }else{
-            abAppend(ab, " ", 1);
-            len++;
-        }
+    screenPut(editor_status, len, SCREEN_INVERSE);
+    // right-align rstatus when it fits, else pad to the edge
+    if(E.screencols - len >= rlen){
+        screenRepeat(' ', E.screencols - len - rlen, SCREEN_INVERSE);
+        screenPut(rstatus, rlen, SCREEN_INVERSE);
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    screenRepeat(' ', E.screencols, SCREEN_INVERSE);
 }
 
-void editorDrawMessageBar(struct abuf *ab){
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(){
     int msglen = strlen(E.statusmsg);
     if(msglen > E.screencols) msglen = E.screencols;
     if(msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+        screenPut(E.statusmsg, msglen, 0);
 }
 
 void editorSetStatusMessage(const char *fmt, ...){
@@ -1090,7 +4421,7 @@ void editorSetStatusMessage(const char *fmt, ...){
 void editorScroll(){
     E.rx = E.cx;
     if(E.cy < E.numrows){
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
     
     if(E.cy < E.rowoffset){
@@ -1107,81 +4438,293 @@ void editorScroll(){
     }
 }
 
-void editorDrawRows(struct  abuf *ab) {
-  int y;
-  for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoffset;
+// Puts n columns of render in one highlight class, control characters
+// shown inverted.
+void editorDrawRun(const char *c, int n, int hl){
+    unsigned char attr = hl == HL_NORMAL ? 0 : editorSyntaxToColor(hl);
+    int j = 0;
+    while(j < n){
+        if(iscntrl((unsigned char)c[j])){
+            char sym = (c[j] >= 0 && c[j] <= 26) ? '@' + c[j] : '?';
+            screenPut(&sym, 1, SCREEN_INVERSE);
+            j++;
+            continue;
+        }
+        int k = j + 1;
+        while(k < n && !iscntrl((unsigned char)c[k])) k++;
+        screenPut(&c[j], k - j, attr);
+        j = k;
+    }
+}
+
+// Composes the screen line showing `filerow`.
+void editorDrawRow(int filerow){
     if (filerow >= E.numrows) {
-      if (E.numrows == 0 && y == E.screenrows / 3){
-          splashScreen(ab);
-      } else {
-          abAppend(ab, "~", 1);
-      }
-    } else {
-        int len = E.row[filerow].size - E.coloffset;
-        if (len < 0) len = 0;
-        if (len > E.screencols) len = E.screencols;
-        char *c = &E.row[filerow].render[E.coloffset];
-        unsigned char *hl = &E.row[filerow].hl[E.coloffset];
-        int current_color = -1;
-        int j;
-        for(j = 0; j < len; j++){
-            if(hl[j] == HL_NORMAL){
-                if(current_color != -1){
-                    abAppend(ab, "\x1b[39m", 5);
-                    current_color = -1;
-                }
-                abAppend(ab, &c[j], 1);
-            }else if(iscntrl(c[j])){
-                char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                abAppend(ab, "\x1b[7m", 4);
-                abAppend(ab, &sym, 1);
-                abAppend(ab, "\x1b[m", 3);
-                if(current_color != -1){
-                    char buf[16];
-                    int clen = snprintf(buf, sizeof(buf), "\x1b[%dm]", current_color);
-                    abAppend(ab, buf, clen);
-                }
-            }else{
-                int color = editorSyntaxToColor(hl[j]);
-                if(color != current_color){
-                    current_color = color;
-                    char buf[16];
-                    int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                    abAppend(ab, buf, clen);
-                }
-                abAppend(ab, &c[j], 1);
+        if (E.numrows == 0 && filerow - E.rowoffset == E.screenrows / 3){
+            splashScreen();
+        } else {
+            screenPut("~", 1, 0);
+        }
+        return;
+    }
+
+    erow *row = editorRowAt(filerow);
+    int end = row->rsize;
+    if (end > E.coloffset + E.screencols) end = E.coloffset + E.screencols;
+
+    // first span that reaches the window
+    int lo = 0, hi = row->nhl;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(row->hl[mid].start + row->hl[mid].len <= E.coloffset) lo = mid + 1;
+        else hi = mid;
+    }
+
+    // each step copies the text up to the next span or match boundary
+    int j = E.coloffset;
+    int s = lo;
+    while(j < end){
+        int hl = HL_NORMAL;
+        int stop = end;
+        if(s < row->nhl && row->hl[s].start + row->hl[s].len <= j) s++;
+        if(s < row->nhl){
+            struct hlSpan *span = &row->hl[s];
+            if(span->start <= j){
+                hl = span->hl;
+                if(stop > span->start + span->len) stop = span->start + span->len;
+            }else if(stop > span->start){
+                stop = span->start;
+            }
+        }
+        if(filerow == E.match_row){
+            if(j >= E.match_from && j < E.match_to){
+                hl = HL_MATCH;
+                if(stop > E.match_to) stop = E.match_to;
+            }else if(j < E.match_from && stop > E.match_from){
+                stop = E.match_from;
             }
         }
-        abAppend(ab, &c[j], 1);
+        editorDrawRun(&row->render[j], stop - j, hl);
+        j = stop;
     }
+}
 
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
-  }
+/*** screen ***/
+
+// Marks file rows [from, to) as needing to be recomposed on the next
+// refresh. Edits, re-lexing and find highlights call this; rows shifting
+// after an insert or delete pass INT_MAX as `to`.
+void editorDamageRows(int from, int to){
+    struct editorScreen *sc = &E.screen;
+    if(from < sc->damage_from) sc->damage_from = from;
+    if(to > sc->damage_to) sc->damage_to = to;
 }
 
-void editorRefreshScreen(){
-    editorScroll();
+// Sizes the shadow for the current window. A new size starts out with
+// cells that match nothing, so everything gets drawn.
+void editorScreenBegin(){
+    struct editorScreen *sc = &E.screen;
+    int rows = E.screenrows + 3;
+    if(sc->rows != rows || sc->cols != E.screencols){
+        size_t cells = (size_t)rows * E.screencols;
+        sc->chars = realloc(sc->chars, cells);
+        sc->attrs = realloc(sc->attrs, cells);
+        sc->line = realloc(sc->line, E.screencols);
+        sc->line_attrs = realloc(sc->line_attrs, E.screencols);
+        if(!sc->chars || !sc->attrs || !sc->line || !sc->line_attrs) die("realloc");
+        memset(sc->chars, 0, cells);
+        memset(sc->attrs, SCREEN_UNKNOWN, cells);
+        sc->rows = rows;
+        sc->cols = E.screencols;
+        sc->cury = sc->curx = -1;
+        sc->attr = -1;
+        editorDamageRows(0, INT_MAX);
+    }
+}
+
+void editorScreenMove(struct abuf *ab, int y, int x){
+    struct editorScreen *sc = &E.screen;
+    char buf[32];
+    int len;
+    if(sc->cury == y && sc->curx == x) return;
+
+    if(sc->cury == y && x == 0){
+        len = snprintf(buf, sizeof(buf), "\r");
+    }else if(sc->cury != -1 && sc->cury + 1 == y && x == 0){
+        len = snprintf(buf, sizeof(buf), "\r\n");
+    }else if(sc->curx != -1 && sc->cury == y && x > sc->curx){
+        len = snprintf(buf, sizeof(buf), "\x1b[%dC", x - sc->curx);
+    }else if(x == 0){
+        len = snprintf(buf, sizeof(buf), "\x1b[%dH", y + 1);
+    }else{
+        len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    }
+    abAppend(ab, buf, len);
+    sc->cury = y;
+    sc->curx = x;
+}
 
-    struct abuf ab = ABUF_INIT;
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
-    editorDrawTopBar(&ab);
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+// Switches the terminal to `attr`, SCREEN_INVERSE plus an SGR foreground.
+void editorScreenAttr(struct abuf *ab, unsigned char attr){
+    struct editorScreen *sc = &E.screen;
+    if(sc->attr == attr) return;
 
-    abAppend(&ab, "\x1b[H", 3);
-    
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoffset) + 2,( E.rx - E.coloffset) + 1);
-    abAppend(&ab, buf, strlen(buf));
-    
-    abAppend(&ab, "\x1b[?25h", 6);
+    int len;
+    int fg = attr & ~SCREEN_INVERSE;
+    if(sc->attr != -1 && !(sc->attr & SCREEN_INVERSE) && !(attr & SCREEN_INVERSE)){
+        len = snprintf(buf, sizeof(buf), "\x1b[%dm", fg ? fg : 39);
+    }else if(attr == 0){
+        len = snprintf(buf, sizeof(buf), "\x1b[m");
+    }else{
+        len = snprintf(buf, sizeof(buf), "\x1b[0%s", (attr & SCREEN_INVERSE) ? ";7" : "");
+        if(fg) len += snprintf(buf + len, sizeof(buf) - len, ";%d", fg);
+        len += snprintf(buf + len, sizeof(buf) - len, "m");
+    }
+    abAppend(ab, buf, len);
+    sc->attr = attr;
+}
+
+// Brings the text lines in line with a new scroll position. A vertical
+// scroll by less than a screen moves the lines already shown with the
+// terminal's own scrolling, confined to the text lines by a scroll region,
+// so that only the rows scrolled into view need drawing.
+void editorScreenScroll(struct abuf *ab){
+    struct editorScreen *sc = &E.screen;
+    int d = E.rowoffset - sc->rowoffset;
+    if(d == 0 && sc->coloffset == E.coloffset) return;
+
+    if(sc->coloffset != E.coloffset || d >= E.screenrows || -d >= E.screenrows){
+        sc->rowoffset = E.rowoffset;
+        sc->coloffset = E.coloffset;
+        editorDamageRows(0, INT_MAX);
+        return;
+    }
+
+    // scrolling fills with the current background, so reset it first
+    char buf[48];
+    editorScreenAttr(ab, 0);
+    int len = snprintf(buf, sizeof(buf), "\x1b[2;%dr\x1b[%d%c\x1b[r",
+        E.screenrows + 1, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+    // setting the scroll region homes the cursor
+    sc->cury = sc->curx = -1;
+
+    int n = d > 0 ? d : -d;
+    int keep = E.screenrows - n;
+    char *chars = &sc->chars[sc->cols];
+    unsigned char *attrs = &sc->attrs[sc->cols];
+    size_t moved = (size_t)keep * sc->cols;
+    size_t exposed = (size_t)n * sc->cols;
+    if(d > 0){
+        memmove(chars, chars + exposed, moved);
+        memmove(attrs, attrs + exposed, moved);
+        memset(chars + moved, ' ', exposed);
+        memset(attrs + moved, 0, exposed);
+        editorDamageRows(E.rowoffset + keep, E.rowoffset + E.screenrows);
+    }else{
+        memmove(chars + exposed, chars, moved);
+        memmove(attrs + exposed, attrs, moved);
+        memset(chars, ' ', exposed);
+        memset(attrs, 0, exposed);
+        editorDamageRows(E.rowoffset, E.rowoffset + n);
+    }
+    sc->rowoffset = E.rowoffset;
+}
+
+// Writes cells [from, to) of the composed line at screen line y.
+void editorScreenPutCells(struct abuf *ab, int y, int from, int to){
+    struct editorScreen *sc = &E.screen;
+    editorScreenMove(ab, y, from);
+    while(from < to){
+        int k = from + 1;
+        while(k < to && sc->line_attrs[k] == sc->line_attrs[from]) k++;
+        editorScreenAttr(ab, sc->line_attrs[from]);
+        abAppend(ab, &sc->line[from], k - from);
+        from = k;
+    }
+    // after the last column the cursor waits to wrap; its place is unclear
+    sc->curx = to < sc->cols ? to : -1;
+}
+
+// Sends the differences between the composed line and what screen line y
+// shows, then records the line as shown. Differing cells closer together
+// than SCREEN_MERGE_GAP go out as one span, since moving the cursor costs
+// more than resending them; a span reaching the line's blank tail ends
+// with an erase instead.
+void editorScreenFlushLine(struct abuf *ab, int y){
+    struct editorScreen *sc = &E.screen;
+    char *chars = &sc->chars[(size_t)y * sc->cols];
+    unsigned char *attrs = &sc->attrs[(size_t)y * sc->cols];
+    screenRepeat(' ', sc->cols, 0);
+
+    int blank = sc->cols;
+    while(blank > 0 && sc->line[blank - 1] == ' ' && sc->line_attrs[blank - 1] == 0) blank--;
+
+    int x = 0;
+    while(x < sc->cols){
+        if(chars[x] == sc->line[x] && attrs[x] == sc->line_attrs[x]){
+            x++;
+            continue;
+        }
+        int last = x;
+        for(int k = x + 1; k < sc->cols && k - last <= SCREEN_MERGE_GAP; k++){
+            if(chars[k] != sc->line[k] || attrs[k] != sc->line_attrs[k]) last = k;
+        }
+        if(last >= blank){
+            editorScreenPutCells(ab, y, x, blank > x ? blank : x);
+            editorScreenAttr(ab, 0);
+            abAppend(ab, "\x1b[K", 3);
+            break;
+        }
+        editorScreenPutCells(ab, y, x, last + 1);
+        x = last + 1;
+    }
+
+    memcpy(chars, sc->line, sc->cols);
+    memcpy(attrs, sc->line_attrs, sc->cols);
+    sc->linelen = 0;
+}
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+void editorRefreshScreen(){
+    // a save that has finished is collected before its status is drawn
+    editorSaveFinish(0);
+    editorScroll();
+    editorHighlightRows(E.rowoffset, E.rowoffset + E.screenrows);
+    editorScreenBegin();
+
+    struct editorScreen *sc = &E.screen;
+    struct abuf *ab = &E.frame;
+    abReset(ab);
+    abAppend(ab, "\x1b[?25l", 6);
+    editorScreenScroll(ab);
+
+    editorDrawTopBar();
+    editorScreenFlushLine(ab, 0);
+    for(int y = 0; y < E.screenrows; y++){
+        int filerow = y + E.rowoffset;
+        if(filerow < sc->damage_from || filerow >= sc->damage_to) continue;
+        editorDrawRow(filerow);
+        editorScreenFlushLine(ab, y + 1);
+    }
+    sc->damage_from = INT_MAX;
+    sc->damage_to = 0;
+    editorDrawStatusBar();
+    editorScreenFlushLine(ab, E.screenrows + 1);
+    editorDrawMessageBar();
+    editorScreenFlushLine(ab, E.screenrows + 2);
+
+    editorScreenAttr(ab, 0);
+    editorScreenMove(ab, (E.cy - E.rowoffset) + 1, E.rx - E.coloffset);
+    abAppend(ab, "\x1b[?25h", 6);
+
+    // SIGWINCH interrupts writes, and a big frame can go out in parts
+    struct iovec iov = {ab->b, ab->len};
+    if(editorWritev(STDOUT_FILENO, &iov, 1) == -1){
+        // the terminal got some unknown part of the frame, so the shadow
+        // no longer says what it shows; the next refresh draws it all
+        sc->rows = 0;
+    }
 }
 
 void clearScreen(){
@@ -1196,18 +4739,240 @@ void checkDirty(){
     }
 }
 
+/*** benchmarks ***/
+
+double benchNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes about `mb` megabytes of generated log lines, ending with `tail`, to
+// a temporary file at `path` and opens it the way the editor would.
+void benchOpenCorpus(char *path, int mb, const char *tail){
+    int fd = mkstemp(path);
+    if(fd == -1) die("mkstemp");
+    FILE *fp = fdopen(fd, "w");
+    if(!fp) die("fdopen");
+
+    long target = (long)mb * 1024 * 1024;
+    long written = 0;
+    unsigned int seed = 1;
+    while(written < target){
+        seed = seed * 1103515245u + 12345u;
+        written += fprintf(fp, "2024-05-17T12:%02u:%02u.%03uZ INFO worker-%02u GET /api/v1/items/%u status=200 latency=%ums\n",
+            (seed >> 8) % 60, (seed >> 14) % 60, (seed >> 4) % 1000, (seed >> 20) % 32, seed % 100000, (seed >> 10) % 900);
+    }
+    fprintf(fp, "%s\n", tail);
+    fclose(fp);
+    openEditor(path);
+}
+
+// Copies every row to a NUL-terminated string, as render used to be, for
+// the string functions the engines are compared with.
+char **benchRender(){
+    char **render = malloc(sizeof(char *) * E.numrows);
+    if(render == NULL) die("malloc");
+    for(int j = 0; j < E.numrows; j++){
+        erow *row = editorRowAt(j);
+        render[j] = malloc(row->size + 1);
+        if(render[j] == NULL) die("malloc");
+        memcpy(render[j], row->chars, row->size);
+        render[j][row->size] = '\0';
+    }
+    return render;
+}
+
+void benchFreeRender(char **render){
+    for(int j = 0; j < E.numrows; j++) free(render[j]);
+    free(render);
+}
+
+// Compares editorSearchForward() with the strstr-over-render loop find used
+// before, on queries that have to scan the whole corpus.
+void editorBenchSearch(int mb){
+    char path[] = "/tmp/bxedtor-bench-XXXXXX";
+    benchOpenCorpus(path, mb, "request failed needle=deadbeefcafe");
+    char *queries[] = {"needle=deadbeefcafe", "status=503", "latency=999ms", NULL};
+
+    // the old path searches a NUL-terminated copy of every row, which it
+    // has to build for a freshly opened file before its first search
+    double render_time = benchNow();
+    char **render = benchRender();
+    render_time = benchNow() - render_time;
+
+    printf("search benchmark: %d MB, %d rows\n", mb, E.numrows);
+    printf("  building render for the strstr path: %.2f ms\n", render_time * 1e3);
+    for(int q = 0; queries[q]; q++){
+        double best_old = 1e9, best_mem = 1e9, best_new = 1e9;
+        int old_row = -1, new_row = -1, cx;
+        const char *mem_match = NULL;
+        for(int rep = 0; rep < 3; rep++){
+            double t = benchNow();
+            old_row = -1;
+            for(int j = 0; j < E.numrows; j++){
+                if(strstr(render[j], queries[q])){
+                    old_row = j;
+                    break;
+                }
+            }
+            t = benchNow() - t;
+            if(t < best_old) best_old = t;
+
+            // memmem at its best: the whole mapping in one call
+            t = benchNow();
+            mem_match = memmem(E.map, E.mapsize, queries[q], strlen(queries[q]));
+            t = benchNow() - t;
+            if(t < best_mem) best_mem = t;
+
+            struct editorSearch search;
+            t = benchNow();
+            editorSearchCompile(&search, queries[q]);
+            new_row = editorSearchForward(&search, 0, E.numrows, &cx);
+            t = benchNow() - t;
+            if(t < best_new) best_new = t;
+        }
+        int same = old_row == new_row && (mem_match != NULL) == (new_row != -1);
+        printf("  %-22s strstr %8.2f ms | memmem %8.2f ms | engine %8.2f ms %8.0f MB/s | x%.1f x%.1f%s\n",
+            queries[q], best_old * 1e3, best_mem * 1e3, best_new * 1e3, mb / best_new,
+            best_old / best_new, best_mem / best_new, same ? "" : "  (MISMATCH)");
+    }
+
+    benchFreeRender(render);
+    editorFreeRows();
+    editorJournalClose(1);
+    unlink(path);
+}
+
+// Counts the rows matching each pattern with the lazy DFA engine and with
+// POSIX regexec() run row by row, as a regex find would otherwise do.
+void editorBenchRegex(int mb){
+    char path[] = "/tmp/bxedtor-bench-XXXXXX";
+    benchOpenCorpus(path, mb, "request failed needle=deadbeefcafe");
+    char *patterns[] = {"needle=[a-f]+cafe", "status=50[0-9]", "(GET|PUT) /api/v1/items/4242 ",
+        "worker-(0|1)[0-9] .*latency=8[0-9]+ms$", "^2024-05-17T12:00:", "(ERROR|WARN|FATAL)", NULL};
+
+    char **render = benchRender();
+
+    printf("regex benchmark: %d MB, %d rows\n", mb, E.numrows);
+    for(int q = 0; patterns[q]; q++){
+        regex_t posix;
+        if(regcomp(&posix, patterns[q], REG_EXTENDED | REG_NOSUB)) die("regcomp");
+        double t_old = benchNow();
+        int old_rows = 0;
+        for(int j = 0; j < E.numrows; j++){
+            if(regexec(&posix, render[j], 0, NULL, 0) == 0) old_rows++;
+        }
+        t_old = benchNow() - t_old;
+        regfree(&posix);
+
+        double t_new = benchNow();
+        struct regex *re = regexCompile(patterns[q]);
+        if(re == NULL) die("regexCompile");
+        struct editorSearch search;
+        editorSearchCompileRegex(&search, re);
+        int new_rows = 0, from = 0, filerow, cx;
+        while((filerow = editorSearchForward(&search, from, E.numrows, &cx)) != -1){
+            new_rows++;
+            from = filerow + 1;
+        }
+        editorSearchFree(&search);
+        regexFree(re);
+        t_new = benchNow() - t_new;
+
+        printf("  %-40s regexec %8.2f ms | engine %8.2f ms %6.0f MB/s | x%.1f | %d rows%s\n",
+            patterns[q], t_old * 1e3, t_new * 1e3, mb / t_new, t_old / t_new, new_rows,
+            old_rows == new_rows ? "" : "  (MISMATCH)");
+    }
+
+    benchFreeRender(render);
+    editorFreeRows();
+    editorJournalClose(1);
+    unlink(path);
+}
+
+// The old way to split the mapped file into rows: a memchr and a row
+// insert per line.
+void benchLoadMapSequential(){
+    char *p = E.map;
+    char *end = E.map + E.mapsize;
+    while(p < end){
+        char *nl = memchr(p, '\n', end - p);
+        char *eol = nl ? nl : end;
+        size_t linelen = eol - p;
+        while(linelen > 0 && p[linelen - 1] == '\r') linelen--;
+        editorInsertBorrowedRow(E.numrows, p, linelen);
+        p = eol + 1;
+    }
+}
+
+// Drops the rows of the mapped file, which own nothing, to index it again.
+void benchDropRows(){
+    free(E.row);
+    E.row = NULL;
+    E.rowcap = E.numrows = E.gapstart = 0;
+}
+
+void editorBenchOpen(int mb){
+    char path[] = "/tmp/bxedtor-bench-XXXXXX";
+    benchOpenCorpus(path, mb, "end of corpus");
+
+    printf("open benchmark: %d MB, %d rows, %d threads\n", mb, E.numrows, editorLoadJobs(E.mapsize));
+    double best_old = 1e9, best_new = 1e9;
+    int old_rows = 0, new_rows = 0;
+    for(int rep = 0; rep < 3; rep++){
+        benchDropRows();
+        double t = benchNow();
+        benchLoadMapSequential();
+        t = benchNow() - t;
+        if(t < best_old) best_old = t;
+        old_rows = E.numrows;
+
+        benchDropRows();
+        t = benchNow();
+        editorLoadMap();
+        t = benchNow() - t;
+        if(t < best_new) best_new = t;
+        new_rows = E.numrows;
+    }
+    printf("  line index: sequential %8.2f ms %8.0f MB/s | parallel %8.2f ms %8.0f MB/s | x%.1f%s\n",
+        best_old * 1e3, mb / best_old, best_new * 1e3, mb / best_new,
+        best_old / best_new, old_rows == new_rows ? "" : "  (MISMATCH)");
+
+    editorFreeRows();
+    editorJournalClose(1);
+    unlink(path);
+}
+
 // init
 int main(int argc, char *argv[]){
+    if(argc >= 2 && !strcmp(argv[1], "--bench-search")){
+        editorBenchSearch(argc >= 3 ? atoi(argv[2]) : 64);
+        return 0;
+    }
+    if(argc >= 2 && !strcmp(argv[1], "--bench-regex")){
+        editorBenchRegex(argc >= 3 ? atoi(argv[2]) : 64);
+        return 0;
+    }
+    if(argc >= 2 && !strcmp(argv[1], "--bench-open")){
+        editorBenchOpen(argc >= 3 ? atoi(argv[2]) : 256);
+        return 0;
+    }
+
     enableRawMode();
     initEditor();
-    if(argc >= 2) openEditor(argv[1]);
-
     editorSetStatusMessage("HELP (Ctrl-G) : Ctrl-S = save | Ctrl-X = quit | Ctrl-F = find | Ctrl-O = Open File");
+    // after the help, so that a recovery message is what shows
+    if(argc >= 2) openEditor(argv[1]);
 
     while(1){
         // checkDirty();
         editorRefreshScreen();
-        editorProcessKeyPress();
+        long long frame = editorNow();
+        // apply everything typed or pasted since, then draw once
+        do{
+            editorProcessKeyPress();
+        }while(editorInputPending() || editorFrameWait(frame));
     }
     return 0;
 }
\ No newline at end of file